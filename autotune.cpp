@@ -0,0 +1,312 @@
+#include "autotune.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <thread>
+
+#include <unistd.h>
+
+#include "codecs.h"
+#include "config.h"
+#include "kernel_check.h"
+
+using namespace std;
+
+// Timed runs per candidate, the fastest counts
+static const int TUNING_REPETITIONS = 5;
+// A candidate has to beat the best so far by this much, so noise does not pick it
+static const double MIN_IMPROVEMENT = 0.03;
+// Synthetic images per timed run at least, so every worker has several
+static const size_t MIN_BATCH_IMAGES = 8;
+
+string cpu_model()
+{
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (getline(cpuinfo, line))
+    {
+        if (line.rfind("model name", 0) == 0 && line.find(':') != string::npos)
+        {
+            return line.substr(line.find_first_not_of(" \t", line.find(':') + 1));
+        }
+    }
+    return "";
+}
+
+string default_tuning_path()
+{
+    char host[256] = "localhost";
+    gethostname(host, sizeof host - 1);
+    const char *home = getenv("HOME");
+    filesystem::path directory = home ? filesystem::path(home) / ".cache" / "box_blur" : filesystem::path(".");
+    return (directory / ("tuning-" + string(host))).string();
+}
+
+bool load_tuning_profile(const string &path, tuning_profile_t &profile)
+{
+    if (!filesystem::exists(path))
+    {
+        return false;
+    }
+    ifstream in(path);
+    if (!in)
+    {
+        throw runtime_error("Failed to open tuning profile " + path);
+    }
+    tuning_profile_t loaded;
+    string line;
+    for (int number = 1; getline(in, line); ++number)
+    {
+        size_t equals = line.find('=');
+        if (line.empty() || line[0] == '#' || equals == string::npos)
+        {
+            continue;
+        }
+        string key = line.substr(0, equals);
+        string value = line.substr(equals + 1);
+        try
+        {
+            if (key == "cpu_model")
+            {
+                loaded.cpu_model = value;
+            }
+            else if (key == "filter_size")
+            {
+                loaded.filter_size = parse_number(value);
+            }
+            else if (key == "kernel")
+            {
+                loaded.kernel = value;
+            }
+            else if (key == "band_rows")
+            {
+                loaded.band_rows = parse_number(value);
+            }
+            else if (key == "tile_width")
+            {
+                loaded.tile_width = parse_number(value);
+            }
+            else if (key == "threads")
+            {
+                loaded.threads = max(1, parse_number(value));
+            }
+            else if (key == "workers")
+            {
+                loaded.workers = max(1, parse_number(value));
+            }
+        }
+        catch (const invalid_argument &e)
+        {
+            throw invalid_argument(path + ":" + to_string(number) + ": " + e.what());
+        }
+    }
+    profile = loaded;
+    return true;
+}
+
+void save_tuning_profile(const string &path, const tuning_profile_t &profile)
+{
+    filesystem::path parent = filesystem::path(path).parent_path();
+    if (!parent.empty())
+    {
+        filesystem::create_directories(parent);
+    }
+    string temporary = path + ".tmp";
+    ofstream out(temporary, ios::trunc);
+    out << "# Written by box_blur --autotune\n"
+        << "cpu_model=" << profile.cpu_model << '\n'
+        << "filter_size=" << profile.filter_size << '\n'
+        << "kernel=" << profile.kernel << '\n'
+        << "band_rows=" << profile.band_rows << '\n'
+        << "tile_width=" << profile.tile_width << '\n'
+        << "threads=" << profile.threads << '\n'
+        << "workers=" << profile.workers << '\n';
+    out.close();
+    if (!out)
+    {
+        throw runtime_error("Failed to write tuning profile " + temporary);
+    }
+    filesystem::rename(temporary, path);
+}
+
+blur_plan_t to_blur_plan(const tuning_profile_t &profile)
+{
+    blur_plan_t plan;
+    plan.kernel = find_kernel_variant(profile.kernel).run;
+    plan.band_rows = profile.band_rows;
+    plan.tile_width = profile.tile_width;
+    plan.threads = profile.threads;
+    return plan;
+}
+
+vector<pair<int, int>> sample_image_sizes(const string &directory, size_t max_samples)
+{
+    vector<string> paths;
+    for (const auto &entry : filesystem::recursive_directory_iterator(directory))
+    {
+        // Raw images are described by their .json sidecars, not counted twice
+        if (entry.is_regular_file() && entry.path().extension() != ".json")
+        {
+            paths.push_back(entry.path().string());
+        }
+    }
+    sort(paths.begin(), paths.end());
+    // Evenly spread over the sorted tree rather than the first directory only
+    size_t step = max<size_t>(1, paths.size() / max(max_samples, size_t(1)));
+    vector<pair<int, int>> sizes;
+    for (size_t i = 0; i < paths.size() && sizes.size() < max_samples; i += step)
+    {
+        try
+        {
+            image_t image = load_image(paths[i]);
+            sizes.emplace_back(image[0][0].size(), image[0].size());
+        }
+        catch (const exception &)
+        {
+            // Whatever the batch would reject does not shape the workload either
+        }
+    }
+    return sizes;
+}
+
+// Seconds for workers threads to blur every image once with plan, fastest of
+// TUNING_REPETITIONS runs
+static double time_plan(const vector<image_t> &images, int filter_size, const blur_plan_t &plan, unsigned workers)
+{
+    double best = 0;
+    for (int repetition = 0; repetition < TUNING_REPETITIONS; ++repetition)
+    {
+        atomic<size_t> next{0};
+        auto work = [&]()
+        {
+            for (size_t i = next++; i < images.size(); i = next++)
+            {
+                blur_image(images[i], filter_size, plan);
+            }
+        };
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (unsigned t = 1; t < workers; ++t)
+        {
+            threads.emplace_back(work);
+        }
+        work();
+        for (thread &t : threads)
+        {
+            t.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = repetition == 0 ? seconds : min(best, seconds);
+    }
+    return best;
+}
+
+tuning_profile_t autotune(const vector<pair<int, int>> &sizes, int filter_size, unsigned max_threads, ostream &log)
+{
+    if (sizes.empty())
+    {
+        throw invalid_argument("No image sizes to tune for");
+    }
+    max_threads = max(1u, max_threads);
+    int max_width = 0;
+    int max_height = 0;
+    for (auto [width, height] : sizes)
+    {
+        max_width = max(max_width, width);
+        max_height = max(max_height, height);
+    }
+
+    vector<image_t> images;
+    for (size_t i = 0; images.size() < max(sizes.size(), MIN_BATCH_IMAGES); ++i)
+    {
+        auto [width, height] = sizes[i % sizes.size()];
+        image_t image(DEFAULT_CHANNELS);
+        for (int c = 0; c < DEFAULT_CHANNELS; ++c)
+        {
+            image[c] = make_test_image(test_pattern_t::random, width, height, i * DEFAULT_CHANNELS + c);
+        }
+        images.push_back(move(image));
+    }
+    image_t expected = blur_image(images[0], filter_size);
+
+    tuning_profile_t best;
+    best.cpu_model = cpu_model();
+    best.filter_size = filter_size;
+    double best_seconds = 0;
+    bool have_best = false;
+    auto consider = [&](const tuning_profile_t &candidate)
+    {
+        blur_plan_t plan = to_blur_plan(candidate);
+        log << "  " << left << setw(12) << candidate.kernel << right << " band " << setw(4) << candidate.band_rows << " tile " << setw(5)
+            << candidate.tile_width << " threads " << setw(3) << candidate.threads << " workers " << setw(3) << candidate.workers << ": ";
+        if (blur_image(images[0], filter_size, plan) != expected)
+        {
+            // A plan that changes the pixels is not a candidate however fast it is
+            log << "wrong result, skipped" << endl;
+            return;
+        }
+        double seconds = time_plan(images, filter_size, plan, candidate.workers);
+        log << fixed << setprecision(2) << seconds * 1000 << " ms" << endl;
+        if (!have_best || seconds < best_seconds * (1 - MIN_IMPROVEMENT))
+        {
+            best = candidate;
+            best_seconds = seconds;
+            have_best = true;
+        }
+    };
+
+    // One dimension at a time instead of the full product, which would take hours:
+    // the kernel on whole planes, then its tile shape, then how the cores are split
+    log << "Kernels:" << endl;
+    for (const kernel_variant_t &variant : kernel_variants())
+    {
+        tuning_profile_t candidate = best;
+        candidate.kernel = variant.name;
+        consider(candidate);
+    }
+
+    log << "Tiles:" << endl;
+    tuning_profile_t untiled = best;
+    for (int band_rows : {0, 16, 64, 256})
+    {
+        for (int tile_width : {0, 256, 1024})
+        {
+            // Tiles as large as every image are the whole plane again
+            if ((band_rows || tile_width) && band_rows < max_height && tile_width < max_width)
+            {
+                tuning_profile_t candidate = untiled;
+                candidate.band_rows = band_rows;
+                candidate.tile_width = tile_width;
+                consider(candidate);
+            }
+        }
+    }
+
+    log << "Threads:" << endl;
+    tuning_profile_t tiled = best;
+    for (unsigned threads = 2; threads <= max_threads; threads *= 2)
+    {
+        tuning_profile_t candidate = tiled;
+        candidate.threads = threads;
+        candidate.workers = max_threads / threads;
+        // Threads of one plane share its tiles, a whole plane would leave them idle
+        if (!candidate.band_rows && !candidate.tile_width)
+        {
+            candidate.band_rows = 64;
+        }
+        consider(candidate);
+    }
+    if (max_threads > 1)
+    {
+        tuning_profile_t candidate = tiled;
+        candidate.workers = max_threads;
+        consider(candidate);
+    }
+    return best;
+}
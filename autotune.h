@@ -0,0 +1,42 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "blur.h"
+
+// Fastest way to run the blur on one host, found by autotune() and kept in a
+// per-host profile that normal runs load at startup
+struct tuning_profile_t
+{
+    std::string cpu_model; // tuned for, a different CPU means the profile is stale
+    int filter_size = 0;
+    std::string kernel = "reference";
+    int band_rows = 0;
+    int tile_width = 0;
+    unsigned threads = 1; // threads per image
+    unsigned workers = 1; // images blurred at the same time
+};
+
+// Model name from /proc/cpuinfo, empty if unknown
+std::string cpu_model();
+
+// ~/.cache/box_blur/tuning-<hostname>, so hosts sharing a home directory keep their own
+std::string default_tuning_path();
+
+// Returns false if there is no profile at path, throws if it cannot be read or a
+// value is malformed (invalid_argument, naming the line)
+bool load_tuning_profile(const std::string &path, tuning_profile_t &profile);
+void save_tuning_profile(const std::string &path, const tuning_profile_t &profile);
+
+blur_plan_t to_blur_plan(const tuning_profile_t &profile);
+
+// Sizes (width, height) of up to max_samples images below directory, as a sample of
+// what the batch runs see
+std::vector<std::pair<int, int>> sample_image_sizes(const std::string &directory, size_t max_samples);
+
+// Times candidate plans on random images of the given sizes and returns the one
+// with the highest throughput on max_threads cores. Progress goes to log.
+tuning_profile_t autotune(const std::vector<std::pair<int, int>> &sizes, int filter_size, unsigned max_threads, std::ostream &log);
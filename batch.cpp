@@ -0,0 +1,650 @@
+#include "batch.h"
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "content_hash.h"
+#include "directory_scanner.h"
+#include "manifest.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "packed_store.h"
+#include "tar_archive.h"
+#include "work_queue.h"
+
+using namespace std;
+
+// Live metrics of every run, updated whether they are exported or not
+static metric_counter_t &images_processed_total = metrics().counter("box_blur_images_processed_total", "Images blurred or served from the cache");
+static metric_counter_t &images_failed_total = metrics().counter("box_blur_images_failed_total", "Inputs that could not be processed");
+static metric_counter_t &images_skipped_total = metrics().counter("box_blur_images_skipped_total", "Inputs skipped as up to date");
+static metric_counter_t &input_bytes_total = metrics().counter("box_blur_input_bytes_total", "Encoded bytes of processed inputs");
+static metric_counter_t &output_bytes_total = metrics().counter("box_blur_output_bytes_total", "Encoded bytes of written outputs");
+static metric_gauge_t &queue_depth = metrics().gauge("box_blur_queue_depth", "Inputs waiting for a worker");
+static metric_gauge_t &in_flight_bytes = metrics().gauge("box_blur_in_flight_bytes", "Mapped input bytes of queued and running jobs");
+
+static size_t queue_capacity(const batch_options_t &options)
+{
+    return options.queue_capacity ? options.queue_capacity : 2 * options.num_threads;
+}
+
+// stdin as seen by stb, optionally limited to the current frame of a stream
+struct stdin_reader_t
+{
+    bool limited;
+    uint64_t remaining;
+};
+
+static int stdin_read(void *user, char *data, int size)
+{
+    auto *reader = static_cast<stdin_reader_t *>(user);
+    if (reader->limited)
+    {
+        size = min<uint64_t>(size, reader->remaining);
+    }
+    size_t n = fread(data, 1, size, stdin);
+    reader->remaining -= reader->limited ? n : 0;
+    return n;
+}
+
+// 64-bit, so the rest of a frame over 2 GiB is skipped whole
+static void stdin_discard(stdin_reader_t *reader, uint64_t n)
+{
+    char discard[4096];
+    for (int read = 0; n > 0 && (read = stdin_read(reader, discard, min<uint64_t>(n, sizeof discard))) > 0; n -= read)
+    {
+    }
+}
+
+static void stdin_skip(void *user, int n)
+{
+    if (n > 0)
+    {
+        stdin_discard(static_cast<stdin_reader_t *>(user), n);
+    }
+}
+
+static int stdin_eof(void *user)
+{
+    auto *reader = static_cast<stdin_reader_t *>(user);
+    return reader->limited ? reader->remaining == 0 : feof(stdin);
+}
+
+// Frames of a length-prefixed stream start with the payload size as 64-bit big-endian
+static bool read_frame_length(uint64_t &length)
+{
+    unsigned char header[8];
+    size_t n = fread(header, 1, sizeof header, stdin);
+    if (n == 0 && feof(stdin))
+    {
+        return false;
+    }
+    if (n != sizeof header)
+    {
+        throw runtime_error("Truncated frame header on stdin");
+    }
+    length = 0;
+    for (unsigned char byte : header)
+    {
+        length = length << 8 | byte;
+    }
+    return true;
+}
+
+static void write_stdout(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, stdout) != size)
+    {
+        throw runtime_error("Failed to write to stdout");
+    }
+}
+
+void run_stdio(bool stream, const batch_options_t &options, map<string, encode_stats_t> &encode_stats, stage_profile_t &stage_profile)
+{
+    static const stbi_io_callbacks callbacks = {stdin_read, stdin_skip, stdin_eof};
+    string label = options.format == image_format_t::png ? describe(options.png_options) : to_string(options.format);
+
+    for (size_t frame = 0;; ++frame)
+    {
+        stdin_reader_t reader = {stream, 0};
+        if (stream && !read_frame_length(reader.remaining))
+        {
+            break;
+        }
+        if (!stream && frame > 0)
+        {
+            break;
+        }
+
+        // stb pulls the bytes from stdin as it decodes, so read time shows up in decode
+        stage_times_t times{"stdin:" + to_string(frame), {}};
+        stage_timer_t timer(times, options.count_events);
+        pixel_buffer_t input;
+        int channels;
+        unsigned char *pixels = stbi_load_from_callbacks(&callbacks, &reader, &input.width, &input.height, &channels, options.channels);
+        if (!pixels)
+        {
+            throw runtime_error("Failed to decode image " + to_string(frame) + " from stdin: " + stbi_failure_reason());
+        }
+        input.channels = options.channels;
+        input.pixels.assign(pixels, pixels + size_t(input.width) * input.height * options.channels);
+        stbi_image_free(pixels);
+        // stb may stop before the end of the frame, e.g. ahead of trailing PNG chunks
+        stdin_discard(&reader, reader.remaining);
+        timer.lap(stage_t::decode);
+        times.pixels = uint64_t(input.width) * input.height;
+
+        image_t input_image = to_image(input);
+        timer.lap(stage_t::deinterleave);
+        image_t output_image = blur_image(input_image, options.filter_size, options.blur_plan, options.border);
+        timer.lap(stage_t::blur);
+        pixel_buffer_t output_pixels = to_pixel_buffer(output_image);
+        timer.lap(stage_t::interleave);
+        vector<unsigned char> encoded = encode_image(output_pixels, options.format, options.png_options, encode_stats[label]);
+        timer.lap(stage_t::encode);
+        if (stream)
+        {
+            unsigned char header[8];
+            for (int i = 0; i < 8; ++i)
+            {
+                header[i] = static_cast<uint64_t>(encoded.size()) >> (56 - 8 * i);
+            }
+            write_stdout(header, sizeof header);
+        }
+        write_stdout(encoded.data(), encoded.size());
+        fflush(stdout);
+        timer.lap(stage_t::write);
+        images_processed_total.add();
+        output_bytes_total.add(encoded.size());
+        stage_profile.add(move(times));
+    }
+}
+
+size_t run_tar(const string &input_tar, const string &output_tar, const batch_options_t &options, map<string, encode_stats_t> &encode_stats,
+               stage_profile_t &stage_profile)
+{
+    struct tar_job_t
+    {
+        size_t index;
+        tar_member_t member;
+        string sidecar;
+        chrono::steady_clock::time_point queued;
+    };
+
+    tar_reader_t reader(input_tar);
+    tar_writer_t writer(output_tar, 4 * options.num_threads);
+    work_queue_t<tar_job_t> jobs(queue_capacity(options));
+    string label = options.format == image_format_t::png ? describe(options.png_options) : to_string(options.format);
+    bool raw = options.format == image_format_t::raw_planar || options.format == image_format_t::raw_interleaved;
+    atomic<size_t> failures{0};
+    mutex stats_mutex;
+    // The first failed archive write; it ends the run, rethrown once the workers are joined
+    exception_ptr write_error;
+    atomic<bool> write_failed{false};
+
+    auto worker = [&](unsigned index)
+    {
+        trace_thread_name("worker " + to_string(index));
+        map<string, encode_stats_t> local_stats;
+        tar_job_t job;
+        while (jobs.pop(job))
+        {
+            queue_depth.add(-1);
+            if (write_failed)
+            {
+                // Left in the queue when it was closed, there is no archive to add it to
+                in_flight_bytes.add(-int64_t(job.member.size));
+                continue;
+            }
+            vector<tar_entry_t> entries;
+            try
+            {
+                clog << "Processing image: " + job.member.name + "\n";
+                // Members are read straight from the mapped archive, read time shows up in decode
+                stage_times_t times{job.member.name, {}};
+                times.queue_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - job.queued).count();
+                stage_timer_t timer(times, options.count_events);
+                pixel_buffer_t input_pixels = decode_pixels(job.member.name, job.member.data, job.member.size, job.sidecar.empty() ? nullptr : &job.sidecar, options.channels);
+                timer.lap(stage_t::decode);
+                times.pixels = uint64_t(input_pixels.width) * input_pixels.height;
+                image_t input_image = to_image(input_pixels);
+                timer.lap(stage_t::deinterleave);
+                image_t output_image = blur_image(input_image, options.filter_size, options.blur_plan, options.border);
+                timer.lap(stage_t::blur);
+                pixel_buffer_t output_pixels = to_pixel_buffer(output_image);
+                timer.lap(stage_t::interleave);
+                string name = filesystem::path(job.member.name).replace_extension(extension(options.format)).string();
+                if (raw)
+                {
+                    // Ahead of its image, so the archive can be read back sequentially
+                    string sidecar = encode_raw_sidecar(output_pixels, options.format == image_format_t::raw_planar);
+                    entries.push_back({raw_sidecar_path(name), vector<unsigned char>(sidecar.begin(), sidecar.end())});
+                }
+                entries.push_back({name, encode_image(output_pixels, options.format, options.png_options, local_stats[label])});
+                timer.lap(stage_t::encode);
+                images_processed_total.add();
+                input_bytes_total.add(job.member.size);
+                output_bytes_total.add(entries.back().data.size());
+                // Archive writes happen on the reorder writer and are not attributed to images
+                stage_profile.add(move(times));
+            }
+            catch (const exception &e)
+            {
+                cerr << "Error, " << job.member.name << ": " << e.what() << endl;
+                failures++;
+                images_failed_total.add();
+                entries.clear();
+            }
+            in_flight_bytes.add(-int64_t(job.member.size));
+            try
+            {
+                // Failed members still take their turn so later results are not held back
+                writer.submit(job.index, move(entries));
+            }
+            catch (...)
+            {
+                lock_guard<mutex> lock(stats_mutex);
+                if (!write_failed.exchange(true))
+                {
+                    write_error = current_exception();
+                }
+                jobs.close();
+            }
+        }
+        lock_guard<mutex> lock(stats_mutex);
+        merge_encode_stats(encode_stats, local_stats);
+    };
+
+    vector<thread> workers;
+    for (unsigned t = 0; t < options.num_threads; ++t)
+    {
+        workers.emplace_back(worker, t);
+    }
+
+    size_t index = 0;
+    map<string, string> sidecars;
+    tar_member_t member;
+    try
+    {
+        while (reader.next(member))
+        {
+            if (filesystem::path(member.name).extension() == ".json")
+            {
+                sidecars[member.name] = string(reinterpret_cast<const char *>(member.data), member.size);
+                continue;
+            }
+            tar_job_t job{index++, member, "", chrono::steady_clock::now()};
+            auto sidecar = sidecars.find(raw_sidecar_path(member.name));
+            if (sidecar != sidecars.end())
+            {
+                job.sidecar = move(sidecar->second);
+                sidecars.erase(sidecar);
+            }
+            queue_depth.add(1);
+            in_flight_bytes.add(member.size);
+            if (!jobs.push(move(job)))
+            {
+                // Closed by a worker whose archive write failed
+                queue_depth.add(-1);
+                in_flight_bytes.add(-int64_t(member.size));
+                break;
+            }
+        }
+    }
+    catch (...)
+    {
+        jobs.close();
+        for (thread &t : workers)
+        {
+            t.join();
+        }
+        throw;
+    }
+
+    jobs.close();
+    for (thread &t : workers)
+    {
+        t.join();
+    }
+    if (write_error)
+    {
+        rethrow_exception(write_error);
+    }
+    writer.close();
+    return failures;
+}
+
+batch_result_t run_directory(const batch_options_t &options, stage_profile_t &stage_profile)
+{
+    if (!filesystem::exists(options.input_directory))
+    {
+        throw runtime_error(options.input_directory + " directory does not exist");
+    }
+
+    if (!filesystem::exists(options.output_directory))
+    {
+        if (!filesystem::create_directory(options.output_directory))
+        {
+            throw runtime_error("cannot create " + options.output_directory + " directory");
+        }
+    }
+
+    if (!filesystem::is_directory(options.output_directory))
+    {
+        throw runtime_error("there is a file named " + options.output_directory + ", it should be a directory");
+    }
+
+    unique_ptr<result_cache_t> cache;
+    if (!options.cache_dir.empty())
+    {
+        cache = make_unique<result_cache_t>(options.cache_dir, options.cache_size);
+    }
+    // Everything besides the input bytes that determines the output
+    string run_parameters = "box_blur-v1 filter=" + to_string(options.filter_size) + " channels=" + to_string(options.channels) + " format=" + to_string(options.format);
+    if (options.border != border_t::copy)
+    {
+        // Only when set, so caches and manifests from before border modes stay valid
+        run_parameters += " border=" + to_string(options.border);
+    }
+    if (options.format == image_format_t::png)
+    {
+        run_parameters += " level=" + to_string(options.png_options.level) + " png_filter=" + to_string(options.png_options.filter);
+    }
+    uint64_t parameters_hash = xxh64(run_parameters.data(), run_parameters.size());
+
+    // Outlives the writer, whose commits record to it
+    unique_ptr<manifest_t> manifest;
+    if (options.incremental)
+    {
+        manifest = make_unique<manifest_t>((filesystem::path(options.output_directory) / MANIFEST_FILENAME).string());
+    }
+
+    output_writer_t writer(options.durability, options.group_commit_files, chrono::milliseconds(options.group_commit_ms));
+    unique_ptr<packed_store_writer_t> store;
+    if (!options.output_store.empty())
+    {
+        if (options.incremental || !options.cache_dir.empty())
+        {
+            throw invalid_argument("an output store cannot be combined with incremental runs or a result cache");
+        }
+        store = make_unique<packed_store_writer_t>(options.output_store, options.store_segment_size, options.num_threads);
+    }
+
+    auto output_path_for = [&](const string &input_path)
+    {
+        // The scanner reports paths as options.input_directory/<relative path>
+        string output_path = options.output_directory + input_path.substr(options.input_directory.length());
+        return filesystem::path(output_path).replace_extension(extension(options.format)).string();
+    };
+
+    // Output subdirectories mirror the input tree and are created on first use
+    mutex directories_mutex;
+    unordered_set<string> output_directories = {options.output_directory};
+    auto ensure_parent = [&](const string &path)
+    {
+        string parent = filesystem::path(path).parent_path().string();
+        lock_guard<mutex> lock(directories_mutex);
+        if (output_directories.insert(parent).second)
+        {
+            filesystem::create_directories(parent);
+        }
+    };
+
+    struct input_job_t
+    {
+        string path;
+        mapped_file_t file;
+        chrono::steady_clock::time_point queued;
+    };
+
+    // The queue holds mapped inputs, so its capacity is also the readahead window
+    work_queue_t<input_job_t> jobs(queue_capacity(options));
+    atomic<size_t> up_to_date{0};
+    atomic<size_t> processed{0};
+    atomic<size_t> failures{0};
+    map<string, encode_stats_t> encode_stats;
+    mutex stats_mutex;
+    string label = options.format == image_format_t::png ? describe(options.png_options) : to_string(options.format);
+
+    // Caches and records an output only once the writer made it durable, so neither the
+    // cache nor --incremental ever trusts an output that a crash can still take away
+    auto committed = [&](const string &input_path, const string &cache_key, const manifest_record_t &record) -> output_writer_t::committed_t
+    {
+        if (!manifest && cache_key.empty())
+        {
+            return {};
+        }
+        return [&, input_path, cache_key, record]()
+        {
+            try
+            {
+                if (!cache_key.empty())
+                {
+                    cache->store(cache_key, extension(options.format), record.output);
+                }
+                if (manifest)
+                {
+                    manifest->record(input_path, record);
+                }
+            }
+            catch (const exception &e)
+            {
+                cerr << "Error, " + input_path + ": " + e.what() + "\n";
+                failures++;
+                images_failed_total.add();
+            }
+        };
+    };
+
+    auto process = [&](input_job_t &job, map<string, encode_stats_t> &local_stats)
+    {
+        string input_image_path = job.path;
+        string output_image_path = output_path_for(input_image_path);
+        clog << "Processing image: " + input_image_path + "\n";
+        stage_times_t times{input_image_path, {}};
+        times.queue_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - job.queued).count();
+        stage_timer_t timer(times, options.count_events);
+
+        manifest_record_t record;
+        if (manifest)
+        {
+            // Taken before reading, a change during the run is picked up next time
+            manifest_t::stat_input(input_image_path, record);
+        }
+
+        vector<unsigned char> input_bytes;
+        if (!options.mmap_input)
+        {
+            input_bytes = read_file(input_image_path);
+        }
+        const unsigned char *input_data = options.mmap_input ? job.file.data() : input_bytes.data();
+        size_t input_size = options.mmap_input ? job.file.size() : input_bytes.size();
+        timer.lap(stage_t::read);
+        input_bytes_total.add(input_size);
+
+        // Hashed once for both the cache key and the manifest, which keeps the first half
+        content_digest_t digest{};
+        if (cache)
+        {
+            digest = content_digest(input_data, input_size);
+        }
+        else if (manifest)
+        {
+            digest.parts[0] = xxh64(input_data, input_size);
+        }
+        record.output = output_image_path;
+        if (manifest)
+        {
+            record.content_hash = digest.parts[0];
+            record.params_hash = parameters_hash;
+        }
+
+        if (!store)
+        {
+            ensure_parent(output_image_path);
+        }
+
+        string cache_key;
+        if (cache)
+        {
+            cache_key = content_key(digest, run_parameters);
+            if (cache->fetch(cache_key, extension(options.format), writer, output_image_path, committed(input_image_path, "", record)))
+            {
+                timer.lap(stage_t::cache);
+                stage_profile.add(move(times));
+                return;
+            }
+        }
+        timer.lap(stage_t::cache);
+
+        pixel_buffer_t input_pixels = decode_pixels(input_image_path, input_data, input_size, nullptr, options.channels);
+        timer.lap(stage_t::decode);
+        times.pixels = uint64_t(input_pixels.width) * input_pixels.height;
+        image_t input_image = to_image(input_pixels);
+        timer.lap(stage_t::deinterleave);
+        image_t output_image = blur_image(input_image, options.filter_size, options.blur_plan, options.border);
+        timer.lap(stage_t::blur);
+        pixel_buffer_t output_pixels = to_pixel_buffer(output_image);
+        timer.lap(stage_t::interleave);
+        vector<unsigned char> encoded = encode_image(output_pixels, options.format, options.png_options, local_stats[label]);
+        timer.lap(stage_t::encode);
+        output_bytes_total.add(encoded.size());
+        if (store)
+        {
+            string name = output_image_path.substr(options.output_directory.length() + 1);
+            store->append(name, encoded.data(), encoded.size());
+            if (options.format == image_format_t::raw_planar || options.format == image_format_t::raw_interleaved)
+            {
+                string sidecar = encode_raw_sidecar(output_pixels, options.format == image_format_t::raw_planar);
+                store->append(raw_sidecar_path(name), reinterpret_cast<const unsigned char *>(sidecar.data()), sidecar.size());
+            }
+        }
+        else
+        {
+            write_image(writer, output_image_path, encoded, output_pixels, options.format, committed(input_image_path, cache_key, record));
+        }
+        timer.lap(stage_t::write);
+        // Comparison encodes are reported with the encoder stats, not as a stage
+        stage_profile.add(move(times));
+        if (options.png_compare)
+        {
+            for (png_preset_t preset : PNG_PRESETS)
+            {
+                png_options_t compare_options = make_png_options(preset);
+                encode_image(output_pixels, image_format_t::png, compare_options, local_stats["compare: " + describe(compare_options)]);
+            }
+        }
+    };
+
+    auto worker = [&](unsigned index)
+    {
+        trace_thread_name("worker " + to_string(index));
+        map<string, encode_stats_t> local_stats;
+        input_job_t job;
+        while (jobs.pop(job))
+        {
+            queue_depth.add(-1);
+            try
+            {
+                process(job, local_stats);
+                processed++;
+                images_processed_total.add();
+            }
+            catch (const exception &e)
+            {
+                cerr << "Error, " + job.path + ": " + e.what() + "\n";
+                failures++;
+                images_failed_total.add();
+            }
+            in_flight_bytes.add(-int64_t(job.file.size()));
+            job.file = mapped_file_t();
+        }
+        lock_guard<mutex> lock(stats_mutex);
+        merge_encode_stats(encode_stats, local_stats);
+    };
+
+    auto start_time = chrono::high_resolution_clock::now();
+    vector<thread> workers;
+    for (unsigned t = 0; t < options.num_threads; ++t)
+    {
+        workers.emplace_back(worker, t);
+    }
+
+    // Producer: paths stream to the workers while the rest of the tree is still being read
+    auto enqueue = [&](const string &path)
+    {
+        // Skip sidecars of raw input images
+        if (filesystem::path(path).extension() == ".json")
+        {
+            return;
+        }
+        input_job_t job{path, mapped_file_t(), chrono::steady_clock::now()};
+        try
+        {
+            if (manifest && manifest->up_to_date(path, parameters_hash, output_path_for(path)))
+            {
+                up_to_date++;
+                images_skipped_total.add();
+                return;
+            }
+            if (options.mmap_input)
+            {
+                // Mapping here starts the readahead while the job waits in the queue
+                job.file = mapped_file_t(path);
+            }
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error, " + path + ": " + e.what() + "\n";
+            failures++;
+            images_failed_total.add();
+            return;
+        }
+        queue_depth.add(1);
+        in_flight_bytes.add(job.file.size());
+        jobs.push(move(job));
+    };
+    // Outputs inside the input tree are not inputs of the next run
+    size_t unreadable = scan_directory_tree(options.input_directory, options.scan_threads, enqueue,
+                                            {options.output_directory, options.output_store, options.cache_dir});
+    jobs.close();
+    for (thread &t : workers)
+    {
+        t.join();
+    }
+    failures += unreadable;
+    images_failed_total.add(unreadable);
+
+    if (store)
+    {
+        store->close();
+    }
+    writer.sync();
+    auto end_time = chrono::high_resolution_clock::now();
+
+    batch_result_t result;
+    result.elapsed = chrono::duration_cast<chrono::milliseconds>(end_time - start_time);
+    result.processed = processed;
+    result.up_to_date = up_to_date;
+    result.failures = failures;
+    result.syncs = writer.syncs();
+    result.encode_stats = move(encode_stats);
+    if (manifest)
+    {
+        manifest->compact();
+    }
+    if (cache)
+    {
+        result.cached = true;
+        result.cache_stats = cache->stats();
+    }
+    return result;
+}
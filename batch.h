@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "blur.h"
+#include "codecs.h"
+#include "image_formats.h"
+#include "output_writer.h"
+#include "result_cache.h"
+#include "stage_profile.h"
+
+static const int DEFAULT_FILTER_SIZE = 5;
+// Written to the output directory by incremental runs
+static const std::string MANIFEST_FILENAME = ".box_blur_manifest";
+
+// Everything that shapes a batch run, shared by the directory, archive and stdio modes
+struct batch_options_t
+{
+    std::string input_directory = "input";
+    std::string output_directory = "output";
+    int filter_size = DEFAULT_FILTER_SIZE;
+    border_t border = border_t::copy;
+    // Inputs are converted to this many channels: 1 gray, 2 gray and alpha, 3 RGB, 4 RGBA
+    int channels = DEFAULT_CHANNELS;
+    // Kernel and tiling of every blur, from the tuning profile
+    blur_plan_t blur_plan;
+    image_format_t format = image_format_t::png;
+    png_options_t png_options = make_png_options(png_preset_t::stb);
+    // Also encode every image with each PNG preset and record the cost
+    bool png_compare = false;
+    // Read inputs through a memory mapping instead of buffered reads
+    bool mmap_input = true;
+    // Only process inputs the manifest does not know as up to date
+    bool incremental = false;
+    durability_t durability = durability_t::none;
+    size_t group_commit_files = 256;
+    int group_commit_ms = 1000;
+    // Append outputs to a packed store in this directory instead of one file each
+    std::string output_store;
+    uint64_t store_segment_size = 1ull << 30;
+    unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned scan_threads = std::min(4u, num_threads);
+    // Inputs read ahead of the workers, 0 for twice the workers
+    size_t queue_capacity = 0;
+    std::string cache_dir;
+    uint64_t cache_size = 0;
+    // Stage timers also read hardware counters
+    bool count_events = false;
+};
+
+struct batch_result_t
+{
+    std::chrono::milliseconds elapsed{0};
+    size_t processed = 0;
+    size_t up_to_date = 0;
+    size_t failures = 0;
+    size_t syncs = 0;
+    std::map<std::string, encode_stats_t> encode_stats;
+    bool cached = false;
+    result_cache_t::stats_t cache_stats;
+};
+
+// Blurs every image below the input directory into the same tree below the output
+// directory. Inputs that fail are reported on stderr and counted in failures; setup
+// problems such as a missing input directory throw.
+batch_result_t run_directory(const batch_options_t &options, stage_profile_t &stage_profile);
+
+// Blurs every image of the input archive on the worker threads and writes the
+// results to the output archive in the input order. Returns the number of members
+// that failed, those are reported and left out of the output.
+size_t run_tar(const std::string &input_tar, const std::string &output_tar, const batch_options_t &options,
+               std::map<std::string, encode_stats_t> &encode_stats, stage_profile_t &stage_profile);
+
+// Blurs one image read from stdin to stdout, or with stream set, every frame of a
+// length-prefixed stream into a stream of the same shape. Nothing touches the filesystem.
+void run_stdio(bool stream, const batch_options_t &options, std::map<std::string, encode_stats_t> &encode_stats, stage_profile_t &stage_profile);
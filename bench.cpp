@@ -0,0 +1,707 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <stdexcept>
+
+#include "blur.h"
+#include "kernel_check.h"
+#include "roofline.h"
+
+using namespace std;
+
+struct bench_options_t
+{
+    vector<double> megapixels = {0.1, 1, 4, 16};
+    vector<int> channels = {1, 3, 4};
+    vector<int> filter_sizes = {3, 5, 9, 15};
+    vector<string> kernels; // empty means all
+    int warmup = 1;
+    int repetitions = 5;
+    bool csv = false;
+    bool verify = false;
+    bool calibrate = false;
+    string json_path;
+    string baseline_path;
+    // A cell regresses when it is slower with p < alpha and by more than tolerance
+    double alpha = 0.01;
+    double tolerance = 0.05;
+};
+
+struct bench_result_t
+{
+    string kernel;
+    double megapixels;
+    int width;
+    int height;
+    int channels;
+    int filter_size;
+    double mean_ms;
+    double stddev_ms;
+    double min_ms;
+    vector<double> samples_ms;
+};
+
+// Identifies a result across runs
+typedef tuple<string, int, int, int, int> cell_key_t;
+
+cell_key_t cell_key(const bench_result_t &r)
+{
+    return {r.kernel, r.width, r.height, r.channels, r.filter_size};
+}
+
+// Keeps the optimizer from dropping kernel calls whose result is unused
+static volatile unsigned bench_sink;
+
+// Whole text as a T, unlike stoi and stod, which also take "5x"
+template <typename T>
+T parse_value(const string &text)
+{
+    stringstream in(text);
+    T parsed;
+    if (!(in >> parsed) || !(in >> ws).eof())
+    {
+        throw invalid_argument("Invalid value " + text);
+    }
+    return parsed;
+}
+
+template <typename T>
+vector<T> parse_list(const string &text)
+{
+    vector<T> values;
+    stringstream in(text);
+    string item;
+    while (getline(in, item, ','))
+    {
+        values.push_back(parse_value<T>(item));
+    }
+    return values;
+}
+
+// Smooth gradients with noise on top, roughly what photos look like to the kernel
+single_channel_image_t synthetic_channel(int width, int height, unsigned seed)
+{
+    mt19937 random(seed);
+    uniform_int_distribution<int> noise(-24, 24);
+    single_channel_image_t image(height, vector<uint8_t>(width));
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            int value = (x * 255 / max(1, width - 1) + y * 255 / max(1, height - 1)) / 2 + noise(random);
+            image[y][x] = clamp(value, 0, 255);
+        }
+    }
+    return image;
+}
+
+bench_result_t run_case(const kernel_variant_t &kernel, const vector<single_channel_image_t> &planes, double megapixels,
+                        int filter_size, const bench_options_t &options)
+{
+    bench_result_t result{kernel.name, megapixels, (int)planes[0][0].size(), (int)planes[0].size(), (int)planes.size(), filter_size, 0, 0, 0, {}};
+
+    vector<double> samples;
+    for (int rep = 0; rep < options.warmup + options.repetitions; ++rep)
+    {
+        auto start_time = chrono::steady_clock::now();
+        for (const single_channel_image_t &plane : planes)
+        {
+            single_channel_image_t blurred = kernel.run(plane, filter_size);
+            bench_sink = bench_sink + blurred[blurred.size() / 2][blurred[0].size() / 2];
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count();
+        if (rep >= options.warmup)
+        {
+            samples.push_back(ms);
+        }
+    }
+
+    double sum = 0;
+    for (double ms : samples)
+    {
+        sum += ms;
+    }
+    result.mean_ms = sum / samples.size();
+    double variance = 0;
+    for (double ms : samples)
+    {
+        variance += (ms - result.mean_ms) * (ms - result.mean_ms);
+    }
+    result.stddev_ms = samples.size() > 1 ? sqrt(variance / (samples.size() - 1)) : 0;
+    result.min_ms = *min_element(samples.begin(), samples.end());
+    result.samples_ms = samples;
+    return result;
+}
+
+void print_result(const bench_result_t &r, bool csv)
+{
+    double pixels = double(r.width) * r.height;
+    double seconds = r.mean_ms / 1000;
+    // Compulsory traffic: every channel byte read once and written once
+    double bytes = 2 * pixels * r.channels;
+    double mp_per_s = pixels / seconds / 1e6;
+    double ns_per_pixel = r.mean_ms * 1e6 / pixels;
+    double gb_per_s = bytes / seconds / 1e9;
+
+    if (csv)
+    {
+        cout << r.kernel << ',' << r.width << ',' << r.height << ',' << r.channels << ',' << r.filter_size << ',' << r.mean_ms << ','
+             << r.stddev_ms << ',' << r.min_ms << ',' << mp_per_s << ',' << ns_per_pixel << ',' << gb_per_s << '\n';
+        return;
+    }
+    cout << left << setw(12) << r.kernel << right << setw(8) << fixed << setprecision(1) << r.megapixels << setw(4) << r.channels
+         << setw(7) << r.filter_size << setw(12) << setprecision(3) << r.mean_ms << setw(9) << setprecision(1)
+         << (r.mean_ms > 0 ? 100 * r.stddev_ms / r.mean_ms : 0) << '%' << setw(12) << setprecision(3) << r.min_ms
+         << setw(10) << setprecision(1) << mp_per_s << setw(10) << setprecision(2) << ns_per_pixel << setw(8) << setprecision(2)
+         << gb_per_s << endl;
+}
+
+// One result per line, so baselines can be diffed and read back without a JSON library
+void write_json(const string &path, const vector<bench_result_t> &results)
+{
+    ofstream out(path);
+    if (!out)
+    {
+        throw runtime_error("Failed to open " + path);
+    }
+    out << "{\"results\": [\n" << setprecision(9);
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const bench_result_t &r = results[i];
+        out << "  {\"kernel\": \"" << r.kernel << "\", \"width\": " << r.width << ", \"height\": " << r.height << ", \"channels\": " << r.channels
+            << ", \"filter_size\": " << r.filter_size << ", \"mean_ms\": " << r.mean_ms << ", \"stddev_ms\": " << r.stddev_ms
+            << ", \"min_ms\": " << r.min_ms << ", \"samples_ms\": [";
+        for (size_t s = 0; s < r.samples_ms.size(); ++s)
+        {
+            out << (s ? ", " : "") << r.samples_ms[s];
+        }
+        out << "]}" << (i + 1 < results.size() ? "," : "") << '\n';
+    }
+    out << "]}\n";
+    if (!out.flush())
+    {
+        throw runtime_error("Failed to write " + path);
+    }
+}
+
+// Value of key in a one-line JSON object written by write_json
+static string json_field(const string &line, const string &key)
+{
+    size_t pos = line.find("\"" + key + "\"");
+    if (pos == string::npos || (pos = line.find(':', pos)) == string::npos)
+    {
+        throw runtime_error("Baseline result is missing \"" + key + "\"");
+    }
+    pos = line.find_first_not_of(" ", pos + 1);
+    if (line[pos] == '"')
+    {
+        return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+    }
+    if (line[pos] == '[')
+    {
+        return line.substr(pos + 1, line.find(']', pos) - pos - 1);
+    }
+    return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+map<cell_key_t, bench_result_t> read_baseline(const string &path)
+{
+    ifstream in(path);
+    if (!in)
+    {
+        throw runtime_error("Failed to open baseline " + path);
+    }
+    map<cell_key_t, bench_result_t> baseline;
+    string line;
+    while (getline(in, line))
+    {
+        if (line.find("\"kernel\"") == string::npos)
+        {
+            continue;
+        }
+        bench_result_t r{};
+        r.kernel = json_field(line, "kernel");
+        r.width = stoi(json_field(line, "width"));
+        r.height = stoi(json_field(line, "height"));
+        r.channels = stoi(json_field(line, "channels"));
+        r.filter_size = stoi(json_field(line, "filter_size"));
+        r.mean_ms = stod(json_field(line, "mean_ms"));
+        r.samples_ms = parse_list<double>(json_field(line, "samples_ms"));
+        baseline[cell_key(r)] = r;
+    }
+    return baseline;
+}
+
+double median(vector<double> values)
+{
+    sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// One-sided Mann-Whitney U test: probability of current being at least this much
+// slower than baseline if both came from the same distribution. Exact for small
+// samples (ties count half), normal approximation with tie correction otherwise.
+double mann_whitney_p_slower(const vector<double> &current, const vector<double> &baseline)
+{
+    size_t n = current.size();
+    size_t m = baseline.size();
+    double u = 0;
+    for (double c : current)
+    {
+        for (double b : baseline)
+        {
+            u += c > b ? 1 : c == b ? 0.5 : 0;
+        }
+    }
+
+    if (n * m <= 400)
+    {
+        // ways[k][u]: arrangements of k current and j baseline samples with statistic u,
+        // built up one baseline sample at a time
+        vector<vector<double>> ways(n + 1, vector<double>(n * m + 1, 0));
+        for (size_t k = 0; k <= n; ++k)
+        {
+            ways[k][0] = 1;
+        }
+        for (size_t j = 1; j <= m; ++j)
+        {
+            vector<vector<double>> next(n + 1, vector<double>(n * m + 1, 0));
+            next[0][0] = 1;
+            for (size_t k = 1; k <= n; ++k)
+            {
+                for (size_t v = 0; v <= n * m; ++v)
+                {
+                    // The largest of k + j samples is either a current one, beating all j baseline
+                    // samples, or a baseline one
+                    next[k][v] = (v >= j ? next[k - 1][v - j] : 0) + ways[k][v];
+                }
+            }
+            ways = move(next);
+        }
+        double total = 0;
+        double at_least = 0;
+        for (size_t v = 0; v <= n * m; ++v)
+        {
+            total += ways[n][v];
+            if (v >= ceil(u - 1e-9))
+            {
+                at_least += ways[n][v];
+            }
+        }
+        return at_least / total;
+    }
+
+    vector<double> all(current);
+    all.insert(all.end(), baseline.begin(), baseline.end());
+    sort(all.begin(), all.end());
+    double ties = 0;
+    for (size_t i = 0; i < all.size();)
+    {
+        size_t j = i;
+        while (j < all.size() && all[j] == all[i])
+        {
+            ++j;
+        }
+        double t = j - i;
+        ties += t * t * t - t;
+        i = j;
+    }
+    double total = n + m;
+    double sigma = sqrt(n * m / 12.0 * ((total + 1) - ties / (total * (total - 1))));
+    if (sigma == 0)
+    {
+        return 1;
+    }
+    double z = (u - n * m / 2.0 - 0.5) / sigma;
+    return 0.5 * erfc(z / sqrt(2));
+}
+
+// Smallest p the exact test gives for n against m samples, when every one of the n is
+// slower: 1 / C(n + m, n). Alpha at or above it can never be reached.
+double mann_whitney_min_p(size_t n, size_t m)
+{
+    double p = 1;
+    for (size_t i = 1; i <= n; ++i)
+    {
+        p = p * i / (m + i);
+    }
+    return p;
+}
+
+// Prints the verdict of every cell, returns the number of regressions
+size_t compare_with_baseline(const vector<bench_result_t> &results, const map<cell_key_t, bench_result_t> &baseline, const bench_options_t &options)
+{
+    size_t regressions = 0;
+    size_t inconclusive = 0;
+    cout << "\nAgainst baseline " << options.baseline_path << " (alpha " << options.alpha << ", tolerance " << 100 * options.tolerance << "%):\n";
+    for (const bench_result_t &r : results)
+    {
+        cout << left << setw(12) << r.kernel << right << setw(6) << r.width << 'x' << left << setw(6) << r.height << right << setw(3)
+             << r.channels << "ch" << setw(4) << r.filter_size << "  ";
+        auto found = baseline.find(cell_key(r));
+        if (found == baseline.end() || found->second.samples_ms.empty())
+        {
+            cout << "new, no baseline\n";
+            continue;
+        }
+        if (mann_whitney_min_p(r.samples_ms.size(), found->second.samples_ms.size()) >= options.alpha)
+        {
+            // Would always read as unchanged, whatever the timings
+            cout << "inconclusive, " << found->second.samples_ms.size() << " baseline samples are too few for alpha " << options.alpha << '\n';
+            inconclusive++;
+            continue;
+        }
+        double change = median(r.samples_ms) / median(found->second.samples_ms) - 1;
+        double p_slower = mann_whitney_p_slower(r.samples_ms, found->second.samples_ms);
+        double p_faster = mann_whitney_p_slower(found->second.samples_ms, r.samples_ms);
+        string verdict = "unchanged";
+        if (p_slower < options.alpha && change > options.tolerance)
+        {
+            verdict = "REGRESSION";
+            regressions++;
+        }
+        else if (p_faster < options.alpha && -change > options.tolerance)
+        {
+            verdict = "faster";
+        }
+        cout << showpos << fixed << setprecision(1) << setw(7) << 100 * change << noshowpos << "%  p=" << setprecision(4)
+             << min(p_slower, p_faster) << "  " << verdict << defaultfloat << '\n';
+    }
+    if (inconclusive)
+    {
+        cerr << "Warning, " << inconclusive << " cells could not be compared, record the baseline with more --reps" << endl;
+    }
+    return regressions;
+}
+
+void print_peaks(const machine_peaks_t &peaks)
+{
+    cout << left << setw(10) << "level" << right << setw(12) << "working set" << setw(12) << "copy GB/s" << setw(12) << "triad GB/s" << '\n';
+    for (const bandwidth_level_t &level : peaks.levels)
+    {
+        cout << left << setw(10) << level.name << right << setw(10) << level.working_set / 1024 << " K" << fixed << setprecision(1) << setw(12)
+             << level.copy_bytes_per_s / 1e9 << setw(12) << level.triad_bytes_per_s / 1e9 << '\n';
+    }
+    cout << "16-bit integer ops: " << peaks.int_ops_per_s / 1e9 << " Gop/s\n\n" << defaultfloat;
+    cout << left << setw(12) << "kernel" << right << setw(8) << "MP" << setw(4) << "ch" << setw(7) << "filter" << setw(8) << "GB/s" << setw(9)
+         << "Gop/s" << setw(9) << "op/byte" << setw(8) << "level" << setw(8) << "bound" << setw(10) << "roof" << setw(9) << "of roof" << endl;
+}
+
+// Places a result on the roofline. Work is counted as the filter_size^2 additions per
+// pixel of the direct method, so kernels that reuse partial sums can exceed 100%.
+void print_roofline(const bench_result_t &r, const machine_peaks_t &peaks)
+{
+    double seconds = r.mean_ms / 1000;
+    double pixels = double(r.width) * r.height * r.channels;
+    double bytes = 2 * pixels;
+    double ops = pixels * r.filter_size * r.filter_size;
+    double intensity = ops / bytes;
+    // One plane is read and written at a time
+    const bandwidth_level_t &level = limiting_level(peaks, 2 * size_t(r.width) * r.height);
+    double memory_roof = intensity * level.copy_bytes_per_s;
+    double roof = min(memory_roof, peaks.int_ops_per_s);
+    cout << left << setw(12) << r.kernel << right << fixed << setprecision(1) << setw(8) << r.megapixels << setw(4) << r.channels
+         << setw(7) << r.filter_size << setprecision(2) << setw(8) << bytes / seconds / 1e9 << setw(9) << ops / seconds / 1e9 << setprecision(1)
+         << setw(9) << intensity << setw(8) << level.name << setw(8) << (memory_roof < peaks.int_ops_per_s ? "memory" : "compute")
+         << setprecision(2) << setw(10) << roof / 1e9 << setprecision(1) << setw(8) << 100 * ops / seconds / roof << '%' << defaultfloat
+         << endl;
+}
+
+// Compares every kernel with the reference on small, odd and adversarial images
+// instead of timing them. Returns the number of mismatches.
+size_t verify_kernels(const vector<kernel_variant_t> &kernels, const vector<int> &filter_sizes)
+{
+    // Includes images narrower and shorter than the filters and sizes that are no multiple of a vector width
+    static const int SHAPES[][2] = {{1, 1}, {1, 9}, {9, 1}, {2, 3}, {3, 2}, {4, 4}, {5, 5}, {6, 17}, {17, 6},
+                                    {15, 15}, {16, 16}, {31, 33}, {64, 3}, {3, 64}, {101, 99}, {257, 31}};
+    static const int RANDOM_SHAPES = 32;
+
+    vector<pair<int, int>> shapes;
+    for (const auto &shape : SHAPES)
+    {
+        shapes.push_back({shape[0], shape[1]});
+    }
+    mt19937 random(1);
+    for (int i = 0; i < RANDOM_SHAPES; ++i)
+    {
+        shapes.push_back({1 + int(random() % 300), 1 + int(random() % 300)});
+    }
+
+    size_t checks = 0;
+    size_t mismatches = 0;
+    for (const auto &[width, height] : shapes)
+    {
+        for (size_t p = 0; p < static_cast<size_t>(test_pattern_t::count); ++p)
+        {
+            test_pattern_t pattern = static_cast<test_pattern_t>(p);
+            single_channel_image_t image = make_test_image(pattern, width, height, width * 1000 + height);
+            for (int filter_size : filter_sizes)
+            {
+                for (const kernel_variant_t &kernel : kernels)
+                {
+                    string mismatch = check_kernel(kernel, image, filter_size);
+                    checks++;
+                    if (!mismatch.empty())
+                    {
+                        mismatches++;
+                        cout << "MISMATCH " << kernel.name << ' ' << to_string(pattern) << ' ' << width << 'x' << height << " filter "
+                             << filter_size << ": " << mismatch << '\n';
+                    }
+                }
+            }
+        }
+    }
+    cout << checks << " checks of " << kernels.size() << " kernels, " << mismatches << " mismatches" << endl;
+    return mismatches;
+}
+
+void print_usage(const char *program)
+{
+    cerr << "Usage: " << program << " [options]\n"
+         << "  --sizes=MP,...        image sizes in megapixels (default 0.1,1,4,16; up to 200)\n"
+         << "  --channels=N,...      channels per image (default 1,3,4)\n"
+         << "  --filters=N,...       filter sizes (default 3,5,9,15)\n"
+         << "  --kernels=NAME,...    kernel variants to run (default all)\n"
+         << "  --warmup=N            untimed runs per case (default 1)\n"
+         << "  --reps=N              timed runs per case (default 5)\n"
+         << "  --csv                 print CSV instead of a table\n"
+         << "  --verify              compare every kernel with the reference on test images instead of timing\n"
+         << "                        (uses --filters, plus 1 and 31)\n"
+         << "  --calibrate           measure bandwidth per cache level and integer throughput, then report\n"
+         << "                        every case against that roofline\n"
+         << "  --json=PATH           also write the results with every sample as JSON, e.g. as a baseline\n"
+         << "  --baseline=PATH       compare with results written by --json, exit 1 on a regression\n"
+         << "  --alpha=P             significance level of the comparison (default 0.01)\n"
+         << "  --tolerance=F         slowdown of the median accepted as noise (default 0.05)\n";
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t options;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            string arg = argv[i];
+            string value = arg.substr(arg.find('=') + 1);
+            if (arg.rfind("--sizes=", 0) == 0)
+            {
+                options.megapixels = parse_list<double>(value);
+            }
+            else if (arg.rfind("--channels=", 0) == 0)
+            {
+                options.channels = parse_list<int>(value);
+            }
+            else if (arg.rfind("--filters=", 0) == 0)
+            {
+                options.filter_sizes = parse_list<int>(value);
+            }
+            else if (arg.rfind("--kernels=", 0) == 0)
+            {
+                options.kernels = parse_list<string>(value);
+            }
+            else if (arg.rfind("--warmup=", 0) == 0)
+            {
+                options.warmup = parse_value<int>(value);
+            }
+            else if (arg.rfind("--reps=", 0) == 0)
+            {
+                options.repetitions = parse_value<int>(value);
+            }
+            else if (arg == "--csv")
+            {
+                options.csv = true;
+            }
+            else if (arg == "--verify")
+            {
+                options.verify = true;
+            }
+            else if (arg == "--calibrate")
+            {
+                options.calibrate = true;
+            }
+            else if (arg.rfind("--json=", 0) == 0)
+            {
+                options.json_path = value;
+            }
+            else if (arg.rfind("--baseline=", 0) == 0)
+            {
+                options.baseline_path = value;
+            }
+            else if (arg.rfind("--alpha=", 0) == 0)
+            {
+                options.alpha = parse_value<double>(value);
+            }
+            else if (arg.rfind("--tolerance=", 0) == 0)
+            {
+                options.tolerance = parse_value<double>(value);
+            }
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        if (options.alpha <= 0 || options.alpha >= 1 || options.tolerance < 0)
+        {
+            throw invalid_argument("Alpha must be between 0 and 1 and tolerance not negative");
+        }
+        if (options.repetitions < 1 || options.warmup < 0)
+        {
+            throw invalid_argument("Repetitions must be at least 1 and warmup not negative");
+        }
+        if (!options.baseline_path.empty() && mann_whitney_min_p(options.repetitions, options.repetitions) >= options.alpha)
+        {
+            int needed = options.repetitions;
+            while (mann_whitney_min_p(needed, needed) >= options.alpha)
+            {
+                ++needed;
+            }
+            ostringstream message;
+            message << "--reps=" << options.repetitions << " can never be significant at alpha " << options.alpha << " (smallest p "
+                    << mann_whitney_min_p(options.repetitions, options.repetitions) << "), use at least --reps=" << needed;
+            throw invalid_argument(message.str());
+        }
+        for (double mp : options.megapixels)
+        {
+            if (mp <= 0 || mp > 1000)
+            {
+                throw invalid_argument("Sizes must be between 0 and 1000 megapixels");
+            }
+        }
+        for (int filter_size : options.filter_sizes)
+        {
+            if (filter_size < 1 || filter_size % 2 == 0)
+            {
+                throw invalid_argument("Filter sizes must be odd and positive");
+            }
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error, " << e.what() << endl;
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    vector<kernel_variant_t> kernels;
+    for (const kernel_variant_t &kernel : kernel_variants())
+    {
+        if (options.kernels.empty() || find(options.kernels.begin(), options.kernels.end(), kernel.name) != options.kernels.end())
+        {
+            kernels.push_back(kernel);
+        }
+    }
+    if (kernels.empty())
+    {
+        cerr << "Error, no kernel matches --kernels" << endl;
+        return 1;
+    }
+
+    if (options.verify)
+    {
+        vector<int> filter_sizes = options.filter_sizes;
+        for (int extra : {1, 31})
+        {
+            if (find(filter_sizes.begin(), filter_sizes.end(), extra) == filter_sizes.end())
+            {
+                filter_sizes.push_back(extra);
+            }
+        }
+        return verify_kernels(kernels, filter_sizes) ? 1 : 0;
+    }
+
+    map<cell_key_t, bench_result_t> baseline;
+    if (!options.baseline_path.empty())
+    {
+        try
+        {
+            baseline = read_baseline(options.baseline_path);
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error, " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    machine_peaks_t peaks;
+    if (options.calibrate)
+    {
+        peaks = calibrate_machine();
+        print_peaks(peaks);
+    }
+    else if (options.csv)
+    {
+        cout << "kernel,width,height,channels,filter_size,mean_ms,stddev_ms,min_ms,mp_per_s,ns_per_pixel,gb_per_s\n";
+    }
+    else
+    {
+        cout << left << setw(12) << "kernel" << right << setw(8) << "MP" << setw(4) << "ch" << setw(7) << "filter" << setw(12) << "mean ms"
+             << setw(10) << "stddev" << setw(12) << "min ms" << setw(10) << "MP/s" << setw(10) << "ns/px" << setw(8) << "GB/s" << endl;
+    }
+
+    vector<bench_result_t> results;
+    for (double mp : options.megapixels)
+    {
+        // 4:3 frames of the requested size
+        int width = max(1, (int)lround(sqrt(mp * 1e6 * 4 / 3)));
+        int height = max(1, (int)lround(mp * 1e6 / width));
+        for (int channels : options.channels)
+        {
+            vector<single_channel_image_t> planes;
+            for (int c = 0; c < channels; ++c)
+            {
+                planes.push_back(synthetic_channel(width, height, c + 1));
+            }
+            for (int filter_size : options.filter_sizes)
+            {
+                for (const kernel_variant_t &kernel : kernels)
+                {
+                    results.push_back(run_case(kernel, planes, mp, filter_size, options));
+                    if (options.calibrate)
+                    {
+                        print_roofline(results.back(), peaks);
+                    }
+                    else
+                    {
+                        print_result(results.back(), options.csv);
+                    }
+                }
+            }
+        }
+    }
+
+    try
+    {
+        if (!options.json_path.empty())
+        {
+            write_json(options.json_path, results);
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error, " << e.what() << endl;
+        return 1;
+    }
+    if (!options.baseline_path.empty())
+    {
+        size_t regressions = compare_with_baseline(results, baseline, options);
+        if (regressions)
+        {
+            cerr << "Error, " << regressions << " regressions against " << options.baseline_path << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,421 @@
+#include "blur.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+single_channel_image_t apply_box_blur(const single_channel_image_t &image, const int filter_size)
+{
+    // Get the dimensions of the input image
+    int width = image[0].size();
+    int height = image.size();
+
+    // Create a new image to store the result
+    single_channel_image_t result(height, vector<uint8_t>(width));
+
+    // Calculate the padding size for the filter
+    int pad = filter_size / 2;
+
+    
+    // Loop through the image pixels, skipping the border pixels
+    for(int row = pad; row < height - pad; row++){
+        for(int col = pad; col < width - pad; col++){
+            // Initialize the sum for the current pixel
+            float sum = 0;
+
+            // Loop through the filter's rows and columns
+            for(int k_row = -pad; k_row < pad + 1; k_row++){
+                for(int k_col = -pad; k_col < pad + 1; k_col++){
+                    // Add the corresponding image pixel value to the sum
+                    sum = sum + image[row + k_row][col + k_col];
+                }
+            }
+
+            // Calculate the average value for the current pixel
+            float average = sum / (filter_size * filter_size);
+
+            // Assign the average value to the corresponding pixel in the result image
+            result[row][col] = average;
+        }
+    }
+
+    // Copy the border pixels from the input image to the result image
+    // (images narrower or shorter than the filter are copied entirely)
+    for(int row=0; row<height; row++){
+        for(int col=0; col<pad && col<width; col++){
+            result[row][col] = image[row][col];
+            result[row][width - col - 1] = image[row][width - col - 1];
+        }
+    }
+
+    for(int col=0; col<width; col++){
+        for(int row=0; row<pad && row<height; row++){
+            result[row][col] = image[row][col];
+            result[height - row - 1][col] = image[height - row - 1][col];
+        }
+    }
+
+    
+
+    return result;
+}
+
+image_t blur_image(const image_t &image, int filter_size)
+{
+    image_t result(image.size());
+    for (size_t i = 0; i < image.size(); ++i)
+    {
+        result[i] = apply_box_blur(image[i], filter_size);
+    }
+    return result;
+}
+
+void check_image_views(const image_view_t &input, const mutable_image_view_t &output, int filter_size)
+{
+    // 64-bit, width * channels of a large view does not fit an int
+    int64_t row_bytes = int64_t(input.width) * input.channels;
+    if (input.width < 1 || input.height < 1 || input.channels < 1 || input.stride < row_bytes)
+    {
+        throw invalid_argument("Invalid input image view");
+    }
+    if (output.width != input.width || output.height != input.height || output.channels != input.channels || output.stride < row_bytes)
+    {
+        throw invalid_argument("Output image view does not match the input");
+    }
+    // Even sizes would center the box off the pixel, larger ones lose exactness
+    if (filter_size < 1 || filter_size % 2 == 0 || filter_size > 2 * MAX_RADIUS + 1)
+    {
+        throw invalid_argument("Filter size must be odd and between 1 and " + to_string(2 * MAX_RADIUS + 1));
+    }
+}
+
+void blur_view(const image_view_t &input, const mutable_image_view_t &output, int filter_size, blur_kernel_t kernel)
+{
+    check_image_views(input, output, filter_size);
+
+    // The kernels work on planes, so each channel goes through one
+    single_channel_image_t plane(input.height, vector<uint8_t>(input.width));
+    for (int c = 0; c < input.channels; ++c)
+    {
+        for (int row = 0; row < input.height; ++row)
+        {
+            const uint8_t *in = input.data + size_t(row) * input.stride + c;
+            for (int col = 0; col < input.width; ++col)
+            {
+                plane[row][col] = in[size_t(col) * input.channels];
+            }
+        }
+        single_channel_image_t blurred = kernel(plane, filter_size);
+        for (int row = 0; row < output.height; ++row)
+        {
+            uint8_t *out = output.data + size_t(row) * output.stride + c;
+            for (int col = 0; col < output.width; ++col)
+            {
+                out[size_t(col) * output.channels] = blurred[row][col];
+            }
+        }
+    }
+}
+
+void blur_view_rows(const image_view_t &input, const mutable_image_view_t &output, int filter_size, int row_begin, int row_end,
+                    vector<uint32_t> &column_sums)
+{
+    check_image_views(input, output, filter_size);
+    int width = input.width;
+    int height = input.height;
+    int channels = input.channels;
+    int pad = filter_size / 2;
+    size_t row_bytes = size_t(width) * channels;
+    // Same float division as apply_box_blur, so the results match it exactly
+    float area = filter_size * filter_size;
+    row_begin = max(row_begin, 0);
+    row_end = min(row_end, height);
+
+    column_sums.assign(row_bytes, 0);
+    bool sums_valid = false;
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        const uint8_t *in = input.data + size_t(row) * input.stride;
+        uint8_t *out = output.data + size_t(row) * output.stride;
+        if (row < pad || row >= height - pad || width <= 2 * pad)
+        {
+            copy(in, in + row_bytes, out);
+            continue;
+        }
+
+        // column_sums[i] holds the sum of byte i over rows row - pad .. row + pad
+        if (!sums_valid)
+        {
+            fill(column_sums.begin(), column_sums.end(), 0);
+            for (int k = row - pad; k <= row + pad; ++k)
+            {
+                const uint8_t *source = input.data + size_t(k) * input.stride;
+                for (size_t i = 0; i < row_bytes; ++i)
+                {
+                    column_sums[i] += source[i];
+                }
+            }
+            sums_valid = true;
+        }
+        else
+        {
+            const uint8_t *leaving = input.data + size_t(row - pad - 1) * input.stride;
+            const uint8_t *entering = input.data + size_t(row + pad) * input.stride;
+            for (size_t i = 0; i < row_bytes; ++i)
+            {
+                column_sums[i] += entering[i] - leaving[i];
+            }
+        }
+
+        copy(in, in + size_t(pad) * channels, out);
+        copy(in + size_t(width - pad) * channels, in + row_bytes, out + size_t(width - pad) * channels);
+        for (int c = 0; c < channels; ++c)
+        {
+            uint32_t sum = 0;
+            for (int col = 0; col < 2 * pad; ++col)
+            {
+                sum += column_sums[size_t(col) * channels + c];
+            }
+            for (int col = pad; col < width - pad; ++col)
+            {
+                sum += column_sums[size_t(col + pad) * channels + c];
+                out[size_t(col) * channels + c] = sum / area;
+                sum -= column_sums[size_t(col - pad) * channels + c];
+            }
+        }
+    }
+}
+
+// blur_view_rows on one plane, so it is benchmarked and verified like the others
+static single_channel_image_t column_sums_box_blur(const single_channel_image_t &image, const int filter_size)
+{
+    int width = image[0].size();
+    int height = image.size();
+    vector<uint8_t> input(size_t(width) * height);
+    for (int row = 0; row < height; ++row)
+    {
+        copy(image[row].begin(), image[row].end(), input.begin() + size_t(row) * width);
+    }
+    vector<uint8_t> output(input.size());
+    vector<uint32_t> column_sums;
+    blur_view_rows({input.data(), width, height, width, 1}, {output.data(), width, height, width, 1}, filter_size, 0, height, column_sums);
+    single_channel_image_t result(height);
+    for (int row = 0; row < height; ++row)
+    {
+        result[row].assign(output.begin() + size_t(row) * width, output.begin() + size_t(row + 1) * width);
+    }
+    return result;
+}
+
+// Sliding window sums, first along every row and then down the columns of those
+// sums, so each pixel costs a constant number of additions whatever the filter size
+static single_channel_image_t separable_box_blur(const single_channel_image_t &image, const int filter_size)
+{
+    int width = image[0].size();
+    int height = image.size();
+    int pad = filter_size / 2;
+    // Starting from a copy leaves the border pixels as apply_box_blur does
+    single_channel_image_t result = image;
+    if (width <= 2 * pad || height <= 2 * pad)
+    {
+        return result;
+    }
+    float area = filter_size * filter_size;
+
+    // row_sums[row * inner + col - pad]: sum of the 2 * pad + 1 pixels of row centred on col
+    int inner = width - 2 * pad;
+    vector<uint32_t> row_sums(size_t(height) * inner);
+    for (int row = 0; row < height; ++row)
+    {
+        const uint8_t *in = image[row].data();
+        uint32_t *sums = &row_sums[size_t(row) * inner];
+        uint32_t sum = 0;
+        for (int col = 0; col < 2 * pad; ++col)
+        {
+            sum += in[col];
+        }
+        for (int col = pad; col < width - pad; ++col)
+        {
+            sum += in[col + pad];
+            sums[col - pad] = sum;
+            sum -= in[col - pad];
+        }
+    }
+
+    vector<uint32_t> window(inner, 0);
+    for (int row = 0; row < 2 * pad; ++row)
+    {
+        const uint32_t *sums = &row_sums[size_t(row) * inner];
+        for (int i = 0; i < inner; ++i)
+        {
+            window[i] += sums[i];
+        }
+    }
+    for (int row = pad; row < height - pad; ++row)
+    {
+        const uint32_t *entering = &row_sums[size_t(row + pad) * inner];
+        const uint32_t *leaving = &row_sums[size_t(row - pad) * inner];
+        uint8_t *out = result[row].data() + pad;
+        for (int i = 0; i < inner; ++i)
+        {
+            window[i] += entering[i];
+            out[i] = window[i] / area;
+            window[i] -= leaving[i];
+        }
+    }
+    return result;
+}
+
+const vector<kernel_variant_t> &kernel_variants()
+{
+    static const vector<kernel_variant_t> variants = {
+        {"reference", apply_box_blur, 0},
+        {"column_sums", column_sums_box_blur, 0},
+        {"separable", separable_box_blur, 0},
+    };
+    return variants;
+}
+
+const kernel_variant_t &find_kernel_variant(const string &name)
+{
+    for (const kernel_variant_t &variant : kernel_variants())
+    {
+        if (name == variant.name)
+        {
+            return variant;
+        }
+    }
+    throw invalid_argument("Unknown kernel " + name);
+}
+
+string to_string(border_t border)
+{
+    switch (border)
+    {
+    case border_t::copy:
+        return "copy";
+    case border_t::clamp:
+        return "clamp";
+    case border_t::mirror:
+        return "mirror";
+    }
+    return "unknown";
+}
+
+border_t parse_border(const string &name)
+{
+    for (border_t border : {border_t::copy, border_t::clamp, border_t::mirror})
+    {
+        if (name == to_string(border))
+        {
+            return border;
+        }
+    }
+    throw invalid_argument("Unknown border " + name);
+}
+
+// Index of the pixel standing in for position i of a row or column of n pixels
+static int border_index(int i, int n, border_t border)
+{
+    if (border == border_t::clamp || n == 1)
+    {
+        return min(max(i, 0), n - 1);
+    }
+    // Reflection without repeating the edge pixel, periodic so any pad works
+    int period = 2 * (n - 1);
+    i = (i % period + period) % period;
+    return i < n ? i : period - i;
+}
+
+single_channel_image_t blur_plane(const single_channel_image_t &image, int filter_size, const blur_plan_t &plan, border_t border)
+{
+    int width = image[0].size();
+    int height = image.size();
+    if (border != border_t::copy)
+    {
+        // Extended by pad pixels on every side, the border pixels become interior ones
+        int pad = filter_size / 2;
+        single_channel_image_t extended(height + 2 * pad, vector<uint8_t>(width + 2 * pad));
+        for (int row = 0; row < height + 2 * pad; ++row)
+        {
+            const vector<uint8_t> &source = image[border_index(row - pad, height, border)];
+            for (int col = 0; col < width + 2 * pad; ++col)
+            {
+                extended[row][col] = source[border_index(col - pad, width, border)];
+            }
+        }
+        single_channel_image_t blurred = blur_plane(extended, filter_size, plan);
+        single_channel_image_t result(height);
+        for (int row = 0; row < height; ++row)
+        {
+            result[row].assign(blurred[row + pad].begin() + pad, blurred[row + pad].begin() + pad + width);
+        }
+        return result;
+    }
+    int band_rows = plan.band_rows > 0 ? min(plan.band_rows, height) : height;
+    int tile_width = plan.tile_width > 0 ? min(plan.tile_width, width) : width;
+    if (band_rows == height && tile_width == width)
+    {
+        return plan.kernel(image, filter_size);
+    }
+
+    int pad = filter_size / 2;
+    int bands = (height + band_rows - 1) / band_rows;
+    int columns = (width + tile_width - 1) / tile_width;
+    single_channel_image_t result(height, vector<uint8_t>(width));
+    atomic<int> next_tile{0};
+    auto work = [&]()
+    {
+        single_channel_image_t tile;
+        for (int t = next_tile++; t < bands * columns; t = next_tile++)
+        {
+            int row_begin = t / columns * band_rows;
+            int row_end = min(height, row_begin + band_rows);
+            int col_begin = t % columns * tile_width;
+            int col_end = min(width, col_begin + tile_width);
+            // The tile plus pad pixels of context on every side away from the image border,
+            // so its pixels come out as if the whole plane had been blurred
+            int top = max(0, row_begin - pad);
+            int bottom = min(height, row_end + pad);
+            int left = max(0, col_begin - pad);
+            int right = min(width, col_end + pad);
+            tile.resize(bottom - top);
+            for (int row = top; row < bottom; ++row)
+            {
+                tile[row - top].assign(image[row].begin() + left, image[row].begin() + right);
+            }
+            single_channel_image_t blurred = plan.kernel(tile, filter_size);
+            for (int row = row_begin; row < row_end; ++row)
+            {
+                const vector<uint8_t> &source = blurred[row - top];
+                copy(source.begin() + (col_begin - left), source.begin() + (col_end - left), result[row].begin() + col_begin);
+            }
+        }
+    };
+
+    unsigned threads = max(1u, min<unsigned>(plan.threads, bands * columns));
+    vector<thread> helpers;
+    for (unsigned t = 1; t < threads; ++t)
+    {
+        helpers.emplace_back(work);
+    }
+    work();
+    for (thread &t : helpers)
+    {
+        t.join();
+    }
+    return result;
+}
+
+image_t blur_image(const image_t &image, int filter_size, const blur_plan_t &plan, border_t border)
+{
+    image_t result(image.size());
+    for (size_t i = 0; i < image.size(); ++i)
+    {
+        result[i] = blur_plane(image[i], filter_size, plan, border);
+    }
+    return result;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Sums of the reference kernel stay exact in a float up to this radius, so filter
+// sizes go up to 2 * MAX_RADIUS + 1
+static const int MAX_RADIUS = 127;
+
+// Image type definition, one plane per channel
+typedef std::vector<std::vector<uint8_t>> single_channel_image_t;
+typedef std::vector<single_channel_image_t> image_t;
+
+// Box blur of one channel; pixels closer than filter_size / 2 to the border are copied
+single_channel_image_t apply_box_blur(const single_channel_image_t &image, const int filter_size);
+
+// apply_box_blur on every channel
+image_t blur_image(const image_t &image, int filter_size);
+
+// A blur kernel implementation, all of them must match apply_box_blur
+typedef single_channel_image_t (*blur_kernel_t)(const single_channel_image_t &image, const int filter_size);
+
+struct kernel_variant_t
+{
+    const char *name;
+    blur_kernel_t run;
+    // Largest difference to the reference allowed in any pixel, 0 for exact
+    int tolerance;
+};
+
+// Every kernel implementation, the reference (apply_box_blur) first
+const std::vector<kernel_variant_t> &kernel_variants();
+
+// Throws invalid_argument for names not in kernel_variants()
+const kernel_variant_t &find_kernel_variant(const std::string &name);
+
+// How blur_plane runs a kernel over one plane. Tiles are blurred separately with
+// filter_size / 2 pixels of context around them, so any plan gives the same pixels
+// as the kernel on the whole plane.
+struct blur_plan_t
+{
+    blur_kernel_t kernel = apply_box_blur;
+    int band_rows = 0;  // rows per tile, 0 for all
+    int tile_width = 0; // columns per tile, 0 for all
+    unsigned threads = 1; // threads sharing the tiles of one plane
+};
+
+// What the pixels closer than filter_size / 2 to the border become
+enum class border_t
+{
+    copy,   // left as they are, like apply_box_blur
+    clamp,  // averaged with the edge pixel repeated outside the image
+    mirror  // averaged with the image reflected at the edge pixel
+};
+
+std::string to_string(border_t border);
+border_t parse_border(const std::string &name);
+
+single_channel_image_t blur_plane(const single_channel_image_t &image, int filter_size, const blur_plan_t &plan,
+                                  border_t border = border_t::copy);
+
+// blur_plane on every channel
+image_t blur_image(const image_t &image, int filter_size, const blur_plan_t &plan, border_t border = border_t::copy);
+
+// Interleaved 8-bit pixels owned by the caller; stride is the distance between
+// the starts of two rows in bytes, at least width * channels
+struct image_view_t
+{
+    const uint8_t *data;
+    int width;
+    int height;
+    int stride;
+    int channels;
+};
+
+struct mutable_image_view_t
+{
+    uint8_t *data;
+    int width;
+    int height;
+    int stride;
+    int channels;
+};
+
+// Throws invalid_argument unless output can take the blur of input with filter_size,
+// which has to be odd and at most 2 * MAX_RADIUS + 1
+void check_image_views(const image_view_t &input, const mutable_image_view_t &output, int filter_size);
+
+// Blurs every channel of input into output, which must have the same size and
+// channels and must not overlap it. Throws invalid_argument on mismatched views.
+void blur_view(const image_view_t &input, const mutable_image_view_t &output, int filter_size, blur_kernel_t kernel = apply_box_blur);
+
+// Rows [row_begin, row_end) of blur_view with the reference kernel, computed in
+// place from running column sums instead of going through planes. Bands of rows
+// can run concurrently as long as each has its own column_sums.
+void blur_view_rows(const image_view_t &input, const mutable_image_view_t &output, int filter_size, int row_begin, int row_end,
+                    std::vector<uint32_t> &column_sums);
@@ -1,176 +1,306 @@
 #include <iostream>
+#include <filesystem>
+#include <map>
+#include <utility>
 #include <vector>
+#include <memory>
 #include <string>
-#include <filesystem>
 #include <chrono>
-#include <thread>
+#include <csignal>
+#include <cstdlib>
+#include <stdexcept>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb_image_write.h>
+#include "autotune.h"
+#include "batch.h"
+#include "codecs.h"
+#include "config.h"
+#include "periodic_task.h"
+#include "stage_profile.h"
+#include "trace_recorder.h"
+#include "metrics.h"
 
 using namespace std;
 
-// CONSTANTS
-static const string INPUT_DIRECTORY = "input";
-static const string OUTPUT_DIRECTORY = "output";
-static const int FILTER_SIZE = 5;
-static const int NUM_CHANNELS = 3;
+// Inputs decoded by --autotune to learn the size distribution
+static const size_t TUNING_SAMPLES = 32;
+// Sizes tuned for when there is no input directory to sample
+static const vector<pair<int, int>> DEFAULT_TUNING_SIZES = {{640, 480}, {1280, 720}, {1920, 1080}};
 
-// Image type definition
-typedef vector<vector<uint8_t>> single_channel_image_t;
-typedef array<single_channel_image_t, NUM_CHANNELS> image_t;
+// Chrome trace written on exit and on SIGUSR1 (set from --trace)
+static string trace_path;
+static volatile sig_atomic_t trace_dump_requested = 0;
 
-image_t load_image(const string &filename)
+static void request_trace_dump(int)
 {
-    int width, height, channels;
+    trace_dump_requested = 1;
+}
 
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &channels, 0);
-    if (!data)
+static void dump_trace()
+{
+    try
     {
-        throw runtime_error("Failed to load image " + filename);
+        trace_dump(trace_path);
     }
-
-    image_t result;
-    for (int i = 0; i < NUM_CHANNELS; ++i)
+    catch (const exception &e)
     {
-        result[i] = single_channel_image_t(height, vector<uint8_t>(width));
+        cerr << "Error, " << e.what() << endl;
     }
+}
 
-    for (int y = 0; y < height; ++y)
+static tuning_profile_t run_autotune(const batch_options_t &options, const string &path)
+{
+    vector<pair<int, int>> sizes;
+    if (filesystem::is_directory(options.input_directory))
     {
-        for (int x = 0; x < width; ++x)
-        {
-            for (int c = 0; c < NUM_CHANNELS; ++c)
-            {
-                result[c][y][x] = data[(y * width + x) * NUM_CHANNELS + c];
-            }
-        }
+        sizes = sample_image_sizes(options.input_directory, TUNING_SAMPLES);
     }
-    stbi_image_free(data);
-    return result;
+    if (sizes.empty())
+    {
+        sizes = DEFAULT_TUNING_SIZES;
+    }
+    clog << "Tuning for " << sizes.size() << " image sizes on " << options.num_threads << " threads" << endl;
+    tuning_profile_t profile = autotune(sizes, options.filter_size, options.num_threads, clog);
+    save_tuning_profile(path, profile);
+    clog << "Tuned: " << profile.kernel << " kernel, band " << profile.band_rows << ", tile " << profile.tile_width << ", "
+         << profile.threads << " threads per image, " << profile.workers << " workers, saved to " << path << endl;
+    return profile;
 }
 
-void write_image(const string &filename, const image_t &image)
+static void apply_tuning_profile(config_t &config)
 {
-    int channels = image.size();
-    int height = image[0].size();
-    int width = image[0][0].size();
-
-    vector<unsigned char> data(height * width * channels);
-
-    for (int y = 0; y < height; ++y)
+    tuning_profile_t profile;
+    try
     {
-        for (int x = 0; x < width; ++x)
+        if (!load_tuning_profile(config.tuning_path, profile))
         {
-            for (int c = 0; c < channels; ++c)
-            {
-                data[(y * width + x) * channels + c] = image[c][y][x];
-            }
+            return;
         }
     }
-    if (!stbi_write_png(filename.c_str(), width, height, channels, data.data(), width * channels))
+    catch (const invalid_argument &e)
+    {
+        // A damaged profile is as stale as one from another CPU, tuning writes a good one
+        cerr << "Warning, " << e.what() << ", tuning again" << endl;
+        profile = run_autotune(config.batch, config.tuning_path);
+    }
+    if (profile.cpu_model != cpu_model())
+    {
+        clog << "CPU changed since " << config.tuning_path << " was tuned, tuning again" << endl;
+        profile = run_autotune(config.batch, config.tuning_path);
+    }
+    if (profile.filter_size != config.batch.filter_size)
+    {
+        cerr << "Warning, " << config.tuning_path << " was tuned for filter size " << profile.filter_size << ", not used" << endl;
+        return;
+    }
+    blur_kernel_t kernel = config.batch.blur_plan.kernel;
+    config.batch.blur_plan = to_blur_plan(profile);
+    if (config.kernel_set)
     {
-        throw runtime_error("Failed to write image");
+        config.batch.blur_plan.kernel = kernel;
+    }
+    if (!config.threads_set)
+    {
+        config.batch.num_threads = profile.workers;
     }
 }
 
-
-single_channel_image_t apply_box_blur(const single_channel_image_t &image, const int filter_size)
+static int run(const config_t &config)
 {
-    // Get the dimensions of the input image
-    int width = image[0].size();
-    int height = image.size();
-
-    // Create a new image to store the result
-    single_channel_image_t result(height, vector<uint8_t>(width));
-
-    // Calculate the padding size for the filter
-    int pad = filter_size / 2;
-
-    
-    // Loop through the image pixels, skipping the border pixels
-    for(int row = pad; row < height - pad; row++){
-        for(int col = pad; col < width - pad; col++){
-            // Initialize the sum for the current pixel
-            float sum = 0;
-
-            // Loop through the filter's rows and columns
-            for(int k_row = -pad; k_row < pad + 1; k_row++){
-                for(int k_col = -pad; k_col < pad + 1; k_col++){
-                    // Add the corresponding image pixel value to the sum
-                    sum = sum + image[row + k_row][col + k_col];
-                }
-            }
+    // Workers already keep every core busy encoding their own images, so a large PNG
+    // is only split across cores when it is the one image in flight
+    if (config.deflate_threads)
+    {
+        set_deflate_threads(config.deflate_threads);
+    }
+    else if (!config.stdio && config.batch.num_threads > 1)
+    {
+        set_deflate_threads(1);
+    }
 
-            // Calculate the average value for the current pixel
-            float average = sum / (filter_size * filter_size);
+    unique_ptr<periodic_task_t> trace_signal_watcher;
+    if (!config.trace_path.empty())
+    {
+        trace_path = config.trace_path;
+        trace_start(config.trace_events);
+        trace_thread_name("main");
+        atexit(dump_trace);
+        // The handler only raises a flag, the dump itself is not async-signal-safe
+        signal(SIGUSR1, request_trace_dump);
+        trace_signal_watcher = make_unique<periodic_task_t>(chrono::milliseconds(100), []()
+                                                            {
+                                                                if (trace_dump_requested)
+                                                                {
+                                                                    trace_dump_requested = 0;
+                                                                    dump_trace();
+                                                                } });
+    }
+    stage_profile_t stage_profile(!config.stage_rows.empty());
+    // Cumulative percentiles while the run goes on, the final ones come with the report
+    unique_ptr<periodic_task_t> latency_reporter;
+    if (config.latency_interval)
+    {
+        latency_reporter = make_unique<periodic_task_t>(chrono::seconds(config.latency_interval), [&]() { stage_profile.print_latencies(clog); });
+    }
 
-            // Assign the average value to the corresponding pixel in the result image
-            result[row][col] = average;
+    // Unregistered before stage_profile goes away, after the servers made their last scrape
+    metrics_collector_t stage_collector;
+    unique_ptr<metrics_server_t> metrics_server;
+    unique_ptr<metrics_file_writer_t> metrics_file_writer;
+    if (config.metrics_port || !config.metrics_file.empty())
+    {
+        stage_collector = metrics().collector([&stage_profile](ostream &out) { stage_profile.write_prometheus(out, "box_blur_stage_latency_seconds"); });
+        try
+        {
+            if (config.metrics_port)
+            {
+                metrics_server = make_unique<metrics_server_t>(metrics(), config.metrics_port);
+            }
+            if (!config.metrics_file.empty())
+            {
+                metrics_file_writer = make_unique<metrics_file_writer_t>(metrics(), config.metrics_file, METRICS_FILE_INTERVAL);
+            }
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error, " << e.what() << endl;
+            return 1;
         }
     }
+    auto report_stages = [&](ostream &out)
+    {
+        latency_reporter.reset();
+        stage_profile.print_summary(out);
+        stage_profile.print_latencies(out);
+        stage_profile.print_events(out);
+        if (!config.stage_rows.empty())
+        {
+            stage_profile.write_rows(config.stage_rows);
+        }
+    };
 
-    // Copy the border pixels from the input image to the result image
-    for(int row=0; row<height; row++){
-        for(int col=0; col<pad; col++){
-            result[row][col] = image[row][col];
-            result[row][width - col - 1] = image[row][width - col - 1];
+    if (!config.input_tar.empty() || !config.output_tar.empty())
+    {
+        map<string, encode_stats_t> encode_stats;
+        size_t failures;
+        auto start_time = chrono::high_resolution_clock::now();
+        try
+        {
+            failures = run_tar(config.input_tar, config.output_tar, config.batch, encode_stats, stage_profile);
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error, " << e.what() << endl;
+            return 1;
         }
+        auto elapsed_time = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start_time);
+        cout << "Elapsed time: " << elapsed_time.count() << " ms" << endl;
+        print_encode_stats(cout, encode_stats);
+        try
+        {
+            report_stages(cout);
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error, " << e.what() << endl;
+            return 1;
+        }
+        return failures ? 1 : 0;
     }
 
-    for(int col=0; col<width; col++){
-        for(int row=0; row<pad; row++){
-            result[row][col] = image[row][col];
-            result[height - row - 1][col] = image[height - row - 1][col];
+    if (config.stdio)
+    {
+        map<string, encode_stats_t> encode_stats;
+        try
+        {
+            run_stdio(config.stdio_stream, config.batch, encode_stats, stage_profile);
+            // stdout carries the images, the report goes to stderr
+            print_encode_stats(cerr, encode_stats);
+            report_stages(cerr);
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error, " << e.what() << endl;
+            return 1;
         }
+        return 0;
     }
 
-    
-
-    return result;
+    batch_result_t result;
+    try
+    {
+        result = run_directory(config.batch, stage_profile);
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error, " << e.what() << endl;
+        return 1;
+    }
+    cout << "Elapsed time: " << result.elapsed.count() << " ms" << endl;
+    print_encode_stats(cout, result.encode_stats);
+    bool report_failed = false;
+    try
+    {
+        report_stages(cout);
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error, " << e.what() << endl;
+        report_failed = true;
+    }
+    if (config.batch.durability != durability_t::none)
+    {
+        cout << "Durability: " << to_string(config.batch.durability) << ", " << result.syncs << " syncs" << endl;
+    }
+    if (config.batch.incremental)
+    {
+        cout << "Incremental: " << result.up_to_date << " up to date, " << result.processed << " processed" << endl;
+    }
+    if (result.cached)
+    {
+        const result_cache_t::stats_t &stats = result.cache_stats;
+        cout << "Cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.stores << " stores, "
+             << stats.evictions << " evictions, " << stats.bytes << " bytes" << endl;
+    }
+    if (result.failures)
+    {
+        cerr << "Error, " << result.failures << " inputs failed" << endl;
+        return 1;
+    }
+    return report_failed ? 1 : 0;
 }
 
 int main(int argc, char *argv[])
 {
-    if (!filesystem::exists(INPUT_DIRECTORY))
+    config_t config;
+    try
     {
-        cerr << "Error, " << INPUT_DIRECTORY << " directory does not exist" << endl;
-        return 1;
+        config = parse_config(argc, argv);
     }
-
-    if (!filesystem::exists(OUTPUT_DIRECTORY))
+    catch (const exception &e)
     {
-        if (!filesystem::create_directory(OUTPUT_DIRECTORY))
-        {
-            cerr << "Error creating" << OUTPUT_DIRECTORY << " directory" << endl;
-            return 1;
-        }
+        cerr << "Error, " << e.what() << endl;
+        print_usage(cerr, argv[0]);
+        return 1;
     }
-
-    if (!filesystem::is_directory(OUTPUT_DIRECTORY))
+    if (config.help)
     {
-        cerr << "Error there is a file named " << OUTPUT_DIRECTORY << ", it should be a directory" << endl;
-        return 1;
+        print_usage(cout, argv[0]);
+        return 0;
     }
 
-    auto start_time = chrono::high_resolution_clock::now();
-    for (auto &file : filesystem::directory_iterator{INPUT_DIRECTORY})
+    try
     {
-        string input_image_path = file.path().string();
-        clog << "Processing image: " << input_image_path << endl;
-        image_t input_image = load_image(input_image_path);
-        image_t output_image;
-        for (int i = 0; i < NUM_CHANNELS; ++i)
+        if (config.autotune)
         {
-            output_image[i] = apply_box_blur(input_image[i], FILTER_SIZE);
+            run_autotune(config.batch, config.tuning_path);
+            return 0;
         }
-        string output_image_path = input_image_path.replace(input_image_path.find(INPUT_DIRECTORY), INPUT_DIRECTORY.length(), OUTPUT_DIRECTORY);
-        write_image(output_image_path, output_image);
+        apply_tuning_profile(config);
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error, " << e.what() << endl;
+        return 1;
     }
-    auto end_time = chrono::high_resolution_clock::now();
-    auto elapsed_time = chrono::duration_cast<chrono::milliseconds>(end_time - start_time);
-    cout << "Elapsed time: " << elapsed_time.count() << " ms" << endl;
-    return 0;
+    return run(config);
 }
@@ -0,0 +1,226 @@
+#include "boxblur.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blur.h"
+
+using namespace std;
+
+// Fewer rows than this per band are not worth waking another thread for
+static const int MIN_BAND_ROWS = 64;
+
+struct boxblur_context
+{
+    explicit boxblur_context(unsigned threads) : scratch(threads)
+    {
+        for (unsigned index = 1; index < threads; ++index)
+        {
+            workers.emplace_back(&boxblur_context::work, this, index);
+        }
+    }
+
+    ~boxblur_context()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping = true;
+        }
+        start.notify_all();
+        for (thread &t : workers)
+        {
+            t.join();
+        }
+    }
+
+    unsigned threads() const
+    {
+        return scratch.size();
+    }
+
+    // Runs task(index) for every thread index, 0 on the calling thread, and rethrows
+    // the first exception any of them raised
+    void run(const function<void(unsigned)> &task)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            task_ = &task;
+            pending = workers.size();
+            error = nullptr;
+            generation++;
+        }
+        start.notify_all();
+        try
+        {
+            task(0);
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(mutex_);
+            error = current_exception();
+        }
+        unique_lock<mutex> lock(mutex_);
+        done.wait(lock, [&] { return pending == 0; });
+        task_ = nullptr;
+        if (error)
+        {
+            rethrow_exception(error);
+        }
+    }
+
+    // Column sums of blur_view_rows, one set per thread
+    vector<vector<uint32_t>> scratch;
+    string last_error;
+
+private:
+    void work(unsigned index)
+    {
+        uint64_t seen = 0;
+        unique_lock<mutex> lock(mutex_);
+        while (true)
+        {
+            start.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+            const function<void(unsigned)> &task = *task_;
+            lock.unlock();
+            exception_ptr failure;
+            try
+            {
+                task(index);
+            }
+            catch (...)
+            {
+                failure = current_exception();
+            }
+            lock.lock();
+            if (failure && !error)
+            {
+                error = failure;
+            }
+            if (--pending == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+
+    vector<thread> workers;
+    mutex mutex_;
+    condition_variable start;
+    condition_variable done;
+    const function<void(unsigned)> *task_ = nullptr;
+    uint64_t generation = 0;
+    size_t pending = 0;
+    bool stopping = false;
+    exception_ptr error;
+};
+
+int boxblur_abi_version(void)
+{
+    return BOXBLUR_ABI_VERSION;
+}
+
+boxblur_context_t *boxblur_context_create(unsigned threads)
+{
+    if (threads == 0)
+    {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    try
+    {
+        return new boxblur_context(threads);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void boxblur_context_destroy(boxblur_context_t *context)
+{
+    delete context;
+}
+
+// Last byte of an image plus one, relative to its first
+static size_t image_extent(int height, int stride, int width, int channels)
+{
+    return size_t(height - 1) * stride + size_t(width) * channels;
+}
+
+boxblur_status_t boxblur_blur(boxblur_context_t *context,
+                              const uint8_t *input, int width, int height, int input_stride, int channels,
+                              uint8_t *output, int output_stride, int filter_size)
+{
+    if (!context)
+    {
+        return BOXBLUR_INVALID_ARGUMENT;
+    }
+    context->last_error.clear();
+    try
+    {
+        if (!input || !output)
+        {
+            throw invalid_argument("Input and output must not be null");
+        }
+        image_view_t in{input, width, height, input_stride, channels};
+        mutable_image_view_t out{output, width, height, output_stride, channels};
+        // Validates the rest before the extents below are computed from it
+        check_image_views(in, out, filter_size);
+        const uint8_t *input_end = input + image_extent(height, input_stride, width, channels);
+        const uint8_t *output_end = output + image_extent(height, output_stride, width, channels);
+        if (input < output_end && output < input_end)
+        {
+            throw invalid_argument("Output overlaps the input");
+        }
+
+        int bands = max(1, min<int>(context->threads(), height / MIN_BAND_ROWS));
+        context->run([&](unsigned index)
+                     {
+                         if (int(index) >= bands)
+                         {
+                             return;
+                         }
+                         int begin = int(int64_t(height) * index / bands);
+                         int end = int(int64_t(height) * (index + 1) / bands);
+                         blur_view_rows(in, out, filter_size, begin, end, context->scratch[index]);
+                     });
+        return BOXBLUR_OK;
+    }
+    catch (const invalid_argument &e)
+    {
+        context->last_error = e.what();
+        return BOXBLUR_INVALID_ARGUMENT;
+    }
+    catch (const bad_alloc &)
+    {
+        context->last_error = "Out of memory";
+        return BOXBLUR_OUT_OF_MEMORY;
+    }
+    catch (const exception &e)
+    {
+        context->last_error = e.what();
+        return BOXBLUR_INTERNAL_ERROR;
+    }
+    catch (...)
+    {
+        context->last_error = "Unknown error";
+        return BOXBLUR_INTERNAL_ERROR;
+    }
+}
+
+const char *boxblur_last_error(const boxblur_context_t *context)
+{
+    return context ? context->last_error.c_str() : "No context";
+}
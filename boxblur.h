@@ -0,0 +1,51 @@
+#pragma once
+
+/* C interface to the box blur for FFI callers (ctypes/cffi, cgo, Rust bindgen).
+ * Images are interleaved 8-bit pixels in buffers owned by the caller, described
+ * by a pointer, width, height, stride (bytes between the starts of two rows) and
+ * channels. Nothing is copied in or out and no call throws. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever a signature or the meaning of an argument changes */
+#define BOXBLUR_ABI_VERSION 1
+
+typedef enum
+{
+    BOXBLUR_OK = 0,
+    BOXBLUR_INVALID_ARGUMENT = 1,
+    BOXBLUR_OUT_OF_MEMORY = 2,
+    BOXBLUR_INTERNAL_ERROR = 3
+} boxblur_status_t;
+
+/* Worker threads and per-thread scratch, reused by every call made with it.
+ * A context must not be used by two threads at the same time; use one per thread. */
+typedef struct boxblur_context boxblur_context_t;
+
+/* BOXBLUR_ABI_VERSION of the library actually loaded */
+int boxblur_abi_version(void);
+
+/* threads = 0 uses all cores. Returns NULL if the context cannot be created. */
+boxblur_context_t *boxblur_context_create(unsigned threads);
+void boxblur_context_destroy(boxblur_context_t *context);
+
+/* Blurs input into output with a filter_size x filter_size box; pixels closer than
+ * filter_size / 2 to the border are copied. Both images have the same width,
+ * height and channels, output must not overlap input. filter_size is odd and at
+ * most 255, anything else returns BOXBLUR_INVALID_ARGUMENT; within that range the
+ * result matches the reference kernel of the box_blur tool exactly. */
+boxblur_status_t boxblur_blur(boxblur_context_t *context,
+                              const uint8_t *input, int width, int height, int input_stride, int channels,
+                              uint8_t *output, int output_stride, int filter_size);
+
+/* Why the last call on this context failed, valid until the next call with it */
+const char *boxblur_last_error(const boxblur_context_t *context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,486 @@
+#include "codecs.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <thread>
+
+#include <zlib.h>
+
+#include "parallel_deflate.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+using namespace std;
+
+// Filtered scanlines smaller than this are deflated on the calling thread
+static const size_t PARALLEL_DEFLATE_THRESHOLD = 4 * PARALLEL_DEFLATE_CHUNK_SIZE;
+
+// Threads used to deflate a single PNG
+static unsigned deflate_threads = max(1u, thread::hardware_concurrency());
+
+// Deflates filtered scanlines, across deflate_threads when there is enough of them
+static vector<unsigned char> zlib_deflate(const unsigned char *data, size_t length, int level)
+{
+    if (deflate_threads > 1 && length >= PARALLEL_DEFLATE_THRESHOLD)
+    {
+        return parallel_deflate(data, length, level, deflate_threads);
+    }
+
+    uLongf compressed_length = compressBound(length);
+    vector<unsigned char> compressed(compressed_length);
+    if (compress2(compressed.data(), &compressed_length, data, length, level) != Z_OK)
+    {
+        throw runtime_error("Failed to compress image");
+    }
+    compressed.resize(compressed_length);
+    return compressed;
+}
+
+void set_deflate_threads(unsigned threads)
+{
+    deflate_threads = max(1u, threads);
+}
+
+png_options_t make_png_options(png_preset_t preset)
+{
+    switch (preset)
+    {
+    case png_preset_t::stb:
+        return {preset, 8, png_filter_t::adaptive};
+    case png_preset_t::fastest:
+        return {preset, 1, png_filter_t::up};
+    case png_preset_t::balanced:
+        return {preset, 6, png_filter_t::paeth};
+    case png_preset_t::smallest:
+        return {preset, 9, png_filter_t::adaptive};
+    }
+    throw invalid_argument("Unknown PNG preset");
+}
+
+string to_string(png_preset_t preset)
+{
+    switch (preset)
+    {
+    case png_preset_t::stb:
+        return "stb";
+    case png_preset_t::fastest:
+        return "fastest";
+    case png_preset_t::balanced:
+        return "balanced";
+    case png_preset_t::smallest:
+        return "smallest";
+    }
+    return "unknown";
+}
+
+string to_string(png_filter_t filter)
+{
+    switch (filter)
+    {
+    case png_filter_t::adaptive:
+        return "adaptive";
+    case png_filter_t::none:
+        return "none";
+    case png_filter_t::sub:
+        return "sub";
+    case png_filter_t::up:
+        return "up";
+    case png_filter_t::average:
+        return "average";
+    case png_filter_t::paeth:
+        return "paeth";
+    }
+    return "unknown";
+}
+
+png_preset_t parse_png_preset(const string &name)
+{
+    for (png_preset_t preset : PNG_PRESETS)
+    {
+        if (to_string(preset) == name)
+        {
+            return preset;
+        }
+    }
+    throw invalid_argument("Unknown PNG preset " + name);
+}
+
+png_filter_t parse_png_filter(const string &name)
+{
+    for (int f = -1; f <= 4; ++f)
+    {
+        if (to_string(png_filter_t(f)) == name)
+        {
+            return png_filter_t(f);
+        }
+    }
+    throw invalid_argument("Unknown PNG filter " + name);
+}
+
+string describe(const png_options_t &options)
+{
+    return to_string(options.preset) + " (level " + to_string(options.level) + ", " + to_string(options.filter) + " filter)";
+}
+
+vector<unsigned char> read_file(const string &filename)
+{
+    ifstream in(filename, ios::binary | ios::ate);
+    if (!in)
+    {
+        throw runtime_error("Failed to open " + filename);
+    }
+    vector<unsigned char> data(in.tellg());
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(data.data()), data.size()))
+    {
+        throw runtime_error("Failed to read " + filename);
+    }
+    return data;
+}
+
+image_t to_image(const pixel_buffer_t &buffer)
+{
+    int width = buffer.width;
+    int height = buffer.height;
+    int channels = buffer.channels;
+
+    image_t result(channels, single_channel_image_t(height, vector<uint8_t>(width)));
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            for (int c = 0; c < channels; ++c)
+            {
+                result[c][y][x] = buffer.pixels[(size_t(y) * width + x) * channels + c];
+            }
+        }
+    }
+    return result;
+}
+
+pixel_buffer_t to_pixel_buffer(const image_t &image)
+{
+    pixel_buffer_t buffer;
+    buffer.channels = image.size();
+    buffer.height = image[0].size();
+    buffer.width = image[0][0].size();
+    buffer.pixels.resize(buffer.height * buffer.width * buffer.channels);
+
+    for (int y = 0; y < buffer.height; ++y)
+    {
+        for (int x = 0; x < buffer.width; ++x)
+        {
+            for (int c = 0; c < buffer.channels; ++c)
+            {
+                buffer.pixels[(y * buffer.width + x) * buffer.channels + c] = image[c][y][x];
+            }
+        }
+    }
+    return buffer;
+}
+
+pixel_buffer_t convert_channels(const pixel_buffer_t &buffer, int channels)
+{
+    int from = buffer.channels;
+    if (from == channels)
+    {
+        return buffer;
+    }
+    if (from < 1 || from > 4 || channels < 1 || channels > 4)
+    {
+        throw invalid_argument("Cannot convert " + to_string(from) + " channels to " + to_string(channels));
+    }
+    pixel_buffer_t result;
+    result.width = buffer.width;
+    result.height = buffer.height;
+    result.channels = channels;
+    size_t count = size_t(buffer.width) * buffer.height;
+    result.pixels.resize(count * channels);
+    bool from_color = from >= 3;
+    bool to_color = channels >= 3;
+    bool from_alpha = from == 2 || from == 4;
+    bool to_alpha = channels == 2 || channels == 4;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint8_t *in = &buffer.pixels[i * from];
+        uint8_t *out = &result.pixels[i * channels];
+        if (to_color)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                out[c] = from_color ? in[c] : in[0];
+            }
+        }
+        else
+        {
+            // Same integer luma as stb
+            out[0] = from_color ? uint8_t((in[0] * 77 + in[1] * 150 + in[2] * 29) >> 8) : in[0];
+        }
+        if (to_alpha)
+        {
+            out[channels - 1] = from_alpha ? in[from - 1] : 255;
+        }
+    }
+    return result;
+}
+
+pixel_buffer_t decode_pixels(const string &filename, const unsigned char *data, size_t length, const string *raw_sidecar, int channels)
+{
+    pixel_buffer_t buffer;
+    switch (format_from_path(filename))
+    {
+    case image_format_t::ppm:
+    case image_format_t::pam:
+        buffer = decode_netpbm(data, length);
+        break;
+    case image_format_t::qoi:
+        buffer = decode_qoi(data, length);
+        break;
+    case image_format_t::raw_planar:
+    case image_format_t::raw_interleaved:
+    {
+        if (raw_sidecar)
+        {
+            buffer = decode_raw(data, length, *raw_sidecar);
+            break;
+        }
+        vector<unsigned char> sidecar = read_file(raw_sidecar_path(filename));
+        buffer = decode_raw(data, length, string(sidecar.begin(), sidecar.end()));
+        break;
+    }
+    case image_format_t::png:
+    {
+        // stb converts while decoding
+        int file_channels;
+        unsigned char *pixels = stbi_load_from_memory(data, length, &buffer.width, &buffer.height, &file_channels, channels);
+        if (!pixels)
+        {
+            throw runtime_error("Failed to load image " + filename + ": " + stbi_failure_reason());
+        }
+        buffer.channels = channels;
+        buffer.pixels.assign(pixels, pixels + size_t(buffer.width) * buffer.height * channels);
+        stbi_image_free(pixels);
+        break;
+    }
+    }
+    if (buffer.channels != channels)
+    {
+        buffer = convert_channels(buffer, channels);
+    }
+    return buffer;
+}
+
+image_t decode_image(const string &filename, const unsigned char *data, size_t length, const string *raw_sidecar, int channels)
+{
+    return to_image(decode_pixels(filename, data, length, raw_sidecar, channels));
+}
+
+image_t load_image(const mapped_file_t &file)
+{
+    return decode_image(file.path(), file.data(), file.size());
+}
+
+image_t load_image(const string &filename)
+{
+    vector<unsigned char> data = read_file(filename);
+    return decode_image(filename, data.data(), data.size());
+}
+
+static int paeth(int left, int up, int up_left)
+{
+    int p = left + up - up_left;
+    int distance_left = abs(p - left);
+    int distance_up = abs(p - up);
+    int distance_up_left = abs(p - up_left);
+    if (distance_left <= distance_up && distance_left <= distance_up_left)
+    {
+        return left;
+    }
+    return distance_up <= distance_up_left ? up : up_left;
+}
+
+// Applies one PNG filter to a row; the first row has no row above (above is null)
+static void filter_png_row(const unsigned char *row, const unsigned char *above, int length, int bpp, png_filter_t filter, unsigned char *out)
+{
+    for (int i = 0; i < length; i++)
+    {
+        int left = i >= bpp ? row[i - bpp] : 0;
+        int up = above ? above[i] : 0;
+        int up_left = above && i >= bpp ? above[i - bpp] : 0;
+        switch (filter)
+        {
+        case png_filter_t::sub:
+            out[i] = row[i] - left;
+            break;
+        case png_filter_t::up:
+            out[i] = row[i] - up;
+            break;
+        case png_filter_t::average:
+            out[i] = row[i] - ((left + up) >> 1);
+            break;
+        case png_filter_t::paeth:
+            out[i] = row[i] - paeth(left, up, up_left);
+            break;
+        default:
+            out[i] = row[i];
+            break;
+        }
+    }
+}
+
+// Sum of the filtered bytes read as signed, stb's estimate of how well a row compresses
+static long filtered_cost(const unsigned char *filtered, int length)
+{
+    long cost = 0;
+    for (int i = 0; i < length; i++)
+    {
+        cost += abs(static_cast<signed char>(filtered[i]));
+    }
+    return cost;
+}
+
+static void append_png_chunk(vector<unsigned char> &png, const char *type, const unsigned char *data, size_t length)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        png.push_back(static_cast<unsigned char>(length >> shift));
+    }
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data, data + length);
+    uLong crc = crc32(0, png.data() + start, png.size() - start);
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        png.push_back(static_cast<unsigned char>(crc >> shift));
+    }
+}
+
+// Writes the PNG itself rather than through stb, whose zlib level and row filter are
+// process-wide globals: every encode carries its own options and none has to wait on
+// another. Adaptive filtering picks rows the way stb does.
+vector<unsigned char> encode_png(const pixel_buffer_t &image, const png_options_t &options)
+{
+    static const unsigned char COLOR_TYPES[] = {0, 0, 4, 2, 6};
+    static const png_filter_t FILTERS[] = {png_filter_t::none, png_filter_t::sub, png_filter_t::up, png_filter_t::average, png_filter_t::paeth};
+    if (image.channels < 1 || image.channels > 4)
+    {
+        throw runtime_error("Failed to encode image");
+    }
+
+    int row_length = image.width * image.channels;
+    vector<unsigned char> filtered(static_cast<size_t>(row_length + 1) * image.height);
+    vector<unsigned char> candidate(row_length);
+    for (int y = 0; y < image.height; y++)
+    {
+        const unsigned char *row = image.pixels.data() + static_cast<size_t>(y) * row_length;
+        const unsigned char *above = y > 0 ? row - row_length : nullptr;
+        unsigned char *out = filtered.data() + static_cast<size_t>(y) * (row_length + 1);
+        png_filter_t filter = options.filter;
+        if (filter == png_filter_t::adaptive)
+        {
+            long best_cost = 0;
+            for (png_filter_t option : FILTERS)
+            {
+                filter_png_row(row, above, row_length, image.channels, option, candidate.data());
+                long cost = filtered_cost(candidate.data(), row_length);
+                if (option == png_filter_t::none || cost < best_cost)
+                {
+                    best_cost = cost;
+                    filter = option;
+                    copy(candidate.begin(), candidate.end(), out + 1);
+                }
+            }
+        }
+        else
+        {
+            filter_png_row(row, above, row_length, image.channels, filter, out + 1);
+        }
+        out[0] = static_cast<unsigned char>(filter);
+    }
+
+    unsigned char header[13] = {};
+    for (int i = 0; i < 4; i++)
+    {
+        header[i] = static_cast<unsigned char>(image.width >> (24 - 8 * i));
+        header[4 + i] = static_cast<unsigned char>(image.height >> (24 - 8 * i));
+    }
+    header[8] = 8;
+    header[9] = COLOR_TYPES[image.channels];
+
+    static const unsigned char SIGNATURE[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    vector<unsigned char> png(begin(SIGNATURE), end(SIGNATURE));
+    vector<unsigned char> compressed = zlib_deflate(filtered.data(), filtered.size(), options.level);
+    append_png_chunk(png, "IHDR", header, sizeof(header));
+    append_png_chunk(png, "IDAT", compressed.data(), compressed.size());
+    append_png_chunk(png, "IEND", nullptr, 0);
+    return png;
+}
+
+vector<unsigned char> encode_image(const pixel_buffer_t &image, image_format_t format, const png_options_t &png_options)
+{
+    switch (format)
+    {
+    case image_format_t::png:
+        return encode_png(image, png_options);
+    case image_format_t::ppm:
+        return encode_ppm(image);
+    case image_format_t::pam:
+        return encode_pam(image);
+    case image_format_t::qoi:
+        return encode_qoi(image);
+    case image_format_t::raw_planar:
+    case image_format_t::raw_interleaved:
+        return encode_raw(image, format == image_format_t::raw_planar);
+    }
+    throw invalid_argument("Unknown image format");
+}
+
+vector<unsigned char> encode_image(const pixel_buffer_t &image, image_format_t format, const png_options_t &png_options, encode_stats_t &stats)
+{
+    auto start_time = chrono::steady_clock::now();
+    vector<unsigned char> encoded = encode_image(image, format, png_options);
+    stats.time += chrono::steady_clock::now() - start_time;
+    stats.images++;
+    stats.bytes += encoded.size();
+    return encoded;
+}
+
+void write_image(output_writer_t &writer, const string &filename, const vector<unsigned char> &encoded, const pixel_buffer_t &image, image_format_t format,
+                 output_writer_t::committed_t committed)
+{
+    if (format == image_format_t::raw_planar || format == image_format_t::raw_interleaved)
+    {
+        // The image goes last, the sync that covers it covers the sidecar as well
+        string sidecar = encode_raw_sidecar(image, format == image_format_t::raw_planar);
+        writer.write(raw_sidecar_path(filename), sidecar.data(), sidecar.size());
+    }
+    writer.write(filename, encoded.data(), encoded.size(), move(committed));
+}
+
+void print_encode_stats(ostream &out, const map<string, encode_stats_t> &stats)
+{
+    out << left << setw(44) << "Encoder" << right << setw(8) << "images" << setw(14) << "bytes"
+         << setw(12) << "encode ms" << setw(14) << "ms/image" << endl;
+    for (const auto &[label, s] : stats)
+    {
+        double ms = chrono::duration<double, milli>(s.time).count();
+        out << left << setw(44) << label << right << setw(8) << s.images << setw(14) << s.bytes
+             << setw(12) << fixed << setprecision(1) << ms << setw(14) << setprecision(3) << (s.images ? ms / s.images : 0.0) << endl;
+    }
+}
+
+void merge_encode_stats(map<string, encode_stats_t> &into, const map<string, encode_stats_t> &from)
+{
+    for (const auto &[label, s] : from)
+    {
+        encode_stats_t &total = into[label];
+        total.images += s.images;
+        total.bytes += s.bytes;
+        total.time += s.time;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "blur.h"
+#include "image_formats.h"
+#include "mapped_file.h"
+#include "output_writer.h"
+
+// Channels decoded images are converted to unless asked otherwise (RGB)
+static const int DEFAULT_CHANNELS = 3;
+
+// PNG encoder settings
+enum class png_preset_t
+{
+    stb,      // stb_image_write's settings, zlib level 8 and per-row adaptive filter, the default
+    fastest,  // zlib level 1, fixed Up filter
+    balanced, // zlib level 6, fixed Paeth filter
+    smallest  // zlib level 9, per-row adaptive filter
+};
+
+// PNG row filter types (adaptive picks one per row)
+enum class png_filter_t
+{
+    adaptive = -1,
+    none = 0,
+    sub = 1,
+    up = 2,
+    average = 3,
+    paeth = 4
+};
+
+struct png_options_t
+{
+    png_preset_t preset;
+    int level;           // zlib level, 0 (stored) to 9
+    png_filter_t filter;
+};
+
+// Accumulated encoder cost for one set of options
+struct encode_stats_t
+{
+    size_t images = 0;
+    size_t bytes = 0;
+    std::chrono::nanoseconds time{0};
+};
+
+static const png_preset_t PNG_PRESETS[] = {png_preset_t::stb, png_preset_t::fastest, png_preset_t::balanced, png_preset_t::smallest};
+
+png_options_t make_png_options(png_preset_t preset);
+std::string to_string(png_preset_t preset);
+std::string to_string(png_filter_t filter);
+png_preset_t parse_png_preset(const std::string &name);
+png_filter_t parse_png_filter(const std::string &name);
+std::string describe(const png_options_t &options);
+
+// Threads used to deflate a single large PNG (default: all cores), from a pool shared
+// by all encodes
+void set_deflate_threads(unsigned threads);
+
+std::vector<unsigned char> read_file(const std::string &filename);
+
+// Between the interleaved pixels of the codecs and the channel planes of the kernels
+image_t to_image(const pixel_buffer_t &buffer);
+pixel_buffer_t to_pixel_buffer(const image_t &image);
+
+// Gray, gray and alpha, RGB and RGBA into each other the way stb converts them
+pixel_buffer_t convert_channels(const pixel_buffer_t &buffer, int channels);
+
+// Decodes an encoded image held in memory into channels channels, filename selects
+// the codec. Raw images take their sidecar from raw_sidecar, or from the file next
+// to filename without it.
+pixel_buffer_t decode_pixels(const std::string &filename, const unsigned char *data, size_t length, const std::string *raw_sidecar = nullptr,
+                             int channels = DEFAULT_CHANNELS);
+image_t decode_image(const std::string &filename, const unsigned char *data, size_t length, const std::string *raw_sidecar = nullptr,
+                     int channels = DEFAULT_CHANNELS);
+image_t load_image(const mapped_file_t &file);
+image_t load_image(const std::string &filename);
+
+std::vector<unsigned char> encode_png(const pixel_buffer_t &image, const png_options_t &options);
+std::vector<unsigned char> encode_image(const pixel_buffer_t &image, image_format_t format, const png_options_t &png_options);
+// Encodes with the given options and records bytes and encode time in stats
+std::vector<unsigned char> encode_image(const pixel_buffer_t &image, image_format_t format, const png_options_t &png_options, encode_stats_t &stats);
+
+// Writes an encoded image, and the sidecar of raw formats next to it; committed runs
+// once both are durable
+void write_image(output_writer_t &writer, const std::string &filename, const std::vector<unsigned char> &encoded, const pixel_buffer_t &image,
+                 image_format_t format, output_writer_t::committed_t committed = {});
+
+void print_encode_stats(std::ostream &out, const std::map<std::string, encode_stats_t> &stats);
+void merge_encode_stats(std::map<std::string, encode_stats_t> &into, const std::map<std::string, encode_stats_t> &from);
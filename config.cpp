@@ -0,0 +1,457 @@
+#include "config.h"
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "autotune.h"
+#include "perf_counters.h"
+
+using namespace std;
+
+// PNG overrides apply on top of the preset whatever order they come in
+struct png_overrides_t
+{
+    int level = -1;
+    png_filter_t filter = png_filter_t::adaptive;
+    bool filter_set = false;
+};
+
+static string trim(const string &text)
+{
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == string::npos)
+    {
+        return "";
+    }
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+// Whole value as a number, unlike stoi, which also takes "12abc"
+int parse_number(const string &value)
+{
+    size_t end = 0;
+    int number = 0;
+    try
+    {
+        number = stoi(value, &end);
+    }
+    catch (const exception &)
+    {
+        end = 0;
+    }
+    if (end == 0 || end != value.size())
+    {
+        throw invalid_argument("Not a number: " + value);
+    }
+    return number;
+}
+
+// arg is one command line option, "--name" or "--name=value"
+static void apply_option(config_t &config, png_overrides_t &png, const string &arg)
+{
+    batch_options_t &options = config.batch;
+    string value = arg.substr(arg.find('=') + 1);
+    if (arg.rfind("--format=", 0) == 0)
+    {
+        options.format = parse_image_format(value);
+    }
+    else if (arg.rfind("--input-dir=", 0) == 0)
+    {
+        options.input_directory = value;
+    }
+    else if (arg.rfind("--output-dir=", 0) == 0)
+    {
+        options.output_directory = value;
+    }
+    else if (arg.rfind("--radius=", 0) == 0)
+    {
+        int radius = parse_number(value);
+        if (radius < 1 || radius > MAX_RADIUS)
+        {
+            throw invalid_argument("Radius must be between 1 and " + to_string(MAX_RADIUS));
+        }
+        options.filter_size = 2 * radius + 1;
+    }
+    else if (arg.rfind("--kernel=", 0) == 0)
+    {
+        options.blur_plan.kernel = find_kernel_variant(value).run;
+        config.kernel_set = true;
+    }
+    else if (arg.rfind("--border=", 0) == 0)
+    {
+        options.border = parse_border(value);
+    }
+    else if (arg.rfind("--channels=", 0) == 0)
+    {
+        options.channels = parse_number(value);
+        if (options.channels < 1 || options.channels > 4)
+        {
+            throw invalid_argument("Channels must be between 1 and 4");
+        }
+    }
+    else if (arg.rfind("--input-io=", 0) == 0)
+    {
+        if (value != "mmap" && value != "stdio")
+        {
+            throw invalid_argument("Unknown input I/O " + value);
+        }
+        options.mmap_input = value == "mmap";
+    }
+    else if (arg == "--stdio" || arg == "--stdio=stream")
+    {
+        config.stdio = true;
+        config.stdio_stream = arg == "--stdio=stream";
+    }
+    else if (arg.rfind("--durability=", 0) == 0)
+    {
+        options.durability = parse_durability(value);
+    }
+    else if (arg.rfind("--group-commit-files=", 0) == 0)
+    {
+        int files = parse_number(value);
+        if (files < 1)
+        {
+            throw invalid_argument("Group commit files must be at least 1");
+        }
+        options.group_commit_files = files;
+    }
+    else if (arg.rfind("--group-commit-ms=", 0) == 0)
+    {
+        options.group_commit_ms = parse_number(value);
+        if (options.group_commit_ms < 1)
+        {
+            throw invalid_argument("Group commit interval must be at least 1 ms");
+        }
+    }
+    else if (arg.rfind("--output-store=", 0) == 0)
+    {
+        options.output_store = value;
+    }
+    else if (arg.rfind("--store-segment-size=", 0) == 0)
+    {
+        options.store_segment_size = parse_byte_size(value);
+    }
+    else if (arg.rfind("--input-tar=", 0) == 0)
+    {
+        config.input_tar = value;
+    }
+    else if (arg.rfind("--output-tar=", 0) == 0)
+    {
+        config.output_tar = value;
+    }
+    else if (arg.rfind("--threads=", 0) == 0)
+    {
+        int threads = parse_number(value);
+        if (threads < 1)
+        {
+            throw invalid_argument("Threads must be at least 1");
+        }
+        options.num_threads = threads;
+        config.threads_set = true;
+    }
+    else if (arg.rfind("--queue-size=", 0) == 0)
+    {
+        int size = parse_number(value);
+        if (size < 1)
+        {
+            throw invalid_argument("Queue size must be at least 1");
+        }
+        options.queue_capacity = size;
+    }
+    else if (arg == "--autotune")
+    {
+        config.autotune = true;
+    }
+    else if (arg.rfind("--tuning-profile=", 0) == 0)
+    {
+        config.tuning_path = value;
+    }
+    else if (arg.rfind("--scan-threads=", 0) == 0)
+    {
+        int threads = parse_number(value);
+        if (threads < 1)
+        {
+            throw invalid_argument("Scan threads must be at least 1");
+        }
+        options.scan_threads = threads;
+    }
+    else if (arg == "--incremental")
+    {
+        options.incremental = true;
+    }
+    else if (arg.rfind("--cache-dir=", 0) == 0)
+    {
+        options.cache_dir = value;
+    }
+    else if (arg.rfind("--cache-size=", 0) == 0)
+    {
+        options.cache_size = parse_byte_size(value);
+    }
+    else if (arg.rfind("--png-preset=", 0) == 0)
+    {
+        options.png_options = make_png_options(parse_png_preset(value));
+    }
+    else if (arg.rfind("--png-level=", 0) == 0)
+    {
+        png.level = parse_number(value);
+        if (png.level < 0 || png.level > 9)
+        {
+            throw invalid_argument("PNG level must be between 0 and 9");
+        }
+    }
+    else if (arg.rfind("--png-filter=", 0) == 0)
+    {
+        png.filter = parse_png_filter(value);
+        png.filter_set = true;
+    }
+    else if (arg.rfind("--deflate-threads=", 0) == 0)
+    {
+        int threads = parse_number(value);
+        if (threads < 1)
+        {
+            throw invalid_argument("Deflate threads must be at least 1");
+        }
+        config.deflate_threads = threads;
+    }
+    else if (arg.rfind("--stage-rows=", 0) == 0)
+    {
+        config.stage_rows = value;
+    }
+    else if (arg.rfind("--trace=", 0) == 0)
+    {
+        config.trace_path = value;
+    }
+    else if (arg.rfind("--trace-events=", 0) == 0)
+    {
+        int events = parse_number(value);
+        if (events < 1)
+        {
+            throw invalid_argument("Trace events must be at least 1");
+        }
+        config.trace_events = events;
+    }
+    else if (arg.rfind("--metrics-port=", 0) == 0)
+    {
+        config.metrics_port = parse_number(value);
+        if (config.metrics_port < 1 || config.metrics_port > 65535)
+        {
+            throw invalid_argument("Metrics port must be between 1 and 65535");
+        }
+    }
+    else if (arg.rfind("--metrics-file=", 0) == 0)
+    {
+        config.metrics_file = value;
+    }
+    else if (arg == "--perf-counters")
+    {
+        options.count_events = true;
+    }
+    else if (arg.rfind("--latency-interval=", 0) == 0)
+    {
+        config.latency_interval = parse_number(value);
+        if (config.latency_interval < 1)
+        {
+            throw invalid_argument("Latency interval must be at least 1 second");
+        }
+    }
+    else if (arg == "--png-compare")
+    {
+        options.png_compare = true;
+    }
+    else
+    {
+        throw invalid_argument("Unknown option");
+    }
+}
+
+// Names where an option came from in its errors, a file line or the argument itself
+static void apply_option(config_t &config, png_overrides_t &png, const string &arg, const string &origin)
+{
+    try
+    {
+        apply_option(config, png, arg);
+    }
+    catch (const exception &e)
+    {
+        throw invalid_argument(origin + ": " + e.what());
+    }
+}
+
+static void read_config_file(const string &path, config_t &config, png_overrides_t &png)
+{
+    ifstream in(path);
+    if (!in)
+    {
+        throw invalid_argument("Failed to open config file " + path);
+    }
+    string line;
+    for (int number = 1; getline(in, line); ++number)
+    {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+        {
+            continue;
+        }
+        size_t equals = line.find('=');
+        string name = trim(line.substr(0, equals));
+        string arg = "--" + name;
+        if (equals != string::npos)
+        {
+            arg += "=" + trim(line.substr(equals + 1));
+        }
+        if (name == "config")
+        {
+            throw invalid_argument(path + ":" + to_string(number) + ": config files cannot include others");
+        }
+        apply_option(config, png, arg, path + ":" + to_string(number));
+    }
+}
+
+// Combinations no run mode accepts, checked before anything starts
+static void validate(config_t &config)
+{
+    const batch_options_t &options = config.batch;
+    bool tar = !config.input_tar.empty() || !config.output_tar.empty();
+    if (tar && (config.input_tar.empty() || config.output_tar.empty() || config.stdio || options.incremental || !options.cache_dir.empty() ||
+                options.png_compare))
+    {
+        throw invalid_argument("archive mode needs both --input-tar and --output-tar and no --stdio, --incremental, --cache-dir or --png-compare");
+    }
+    if (config.stdio && (options.incremental || !options.cache_dir.empty()))
+    {
+        throw invalid_argument("--stdio cannot be combined with --incremental or --cache-dir");
+    }
+    if (!options.output_store.empty() && (options.incremental || !options.cache_dir.empty()))
+    {
+        throw invalid_argument("--output-store cannot be combined with --incremental or --cache-dir");
+    }
+    if (options.format == image_format_t::qoi && options.channels < 3)
+    {
+        throw invalid_argument("QOI needs 3 or 4 channels");
+    }
+    if (options.format == image_format_t::ppm && options.channels != 1 && options.channels != 3)
+    {
+        throw invalid_argument("PPM needs 1 or 3 channels, use PAM for alpha");
+    }
+    if (options.count_events)
+    {
+        string reason = perf_counters_unavailable();
+        if (!reason.empty())
+        {
+            // Not fatal, the run goes on without counters
+            cerr << "Warning, hardware counters unavailable: " << reason << endl;
+            config.batch.count_events = false;
+        }
+    }
+}
+
+config_t parse_config(int argc, char *argv[])
+{
+    config_t config;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            config.help = true;
+            return config;
+        }
+    }
+    png_overrides_t png;
+    png.filter = config.batch.png_options.filter;
+    // The file first wherever --config is, so the command line wins
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg.rfind("--config=", 0) == 0)
+        {
+            read_config_file(arg.substr(arg.find('=') + 1), config, png);
+        }
+    }
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg.rfind("--config=", 0) != 0)
+        {
+            apply_option(config, png, arg, arg);
+        }
+    }
+    if (png.level >= 0)
+    {
+        config.batch.png_options.level = png.level;
+    }
+    if (png.filter_set)
+    {
+        config.batch.png_options.filter = png.filter;
+    }
+    if (config.tuning_path.empty())
+    {
+        config.tuning_path = default_tuning_path();
+    }
+    validate(config);
+    return config;
+}
+
+void print_usage(ostream &out, const char *program)
+{
+    batch_options_t defaults;
+    out << "Usage: " << program << " [options]\n"
+        << "  --help, -h                              print this and exit\n"
+        << "  --config=PATH                           read options from PATH, one per line without the dashes\n"
+        << "                                          (e.g. \"radius = 3\"); options given here override them\n"
+        << "  --input-dir=PATH                        directory of the input images (default " << defaults.input_directory << ")\n"
+        << "  --output-dir=PATH                       directory the blurred images go to (default " << defaults.output_directory << ")\n"
+        << "  --radius=R                              blur with a (2R+1) x (2R+1) box, R up to " << MAX_RADIUS << " (default "
+        << DEFAULT_FILTER_SIZE / 2 << ")\n"
+        << "  --border=copy|clamp|mirror              keep the pixels closer than R to the border (default), or blur them\n"
+        << "                                          with the edge pixel repeated or the image mirrored outside\n"
+        << "  --kernel=NAME                           kernel variant, as listed by box_blur_bench (default: tuned, or\n"
+        << "                                          reference)\n"
+        << "  --channels=1|2|3|4                      convert inputs to gray, gray+alpha, RGB or RGBA (default 3)\n"
+        << "  --stdio[=stream]                        blur one image from stdin to stdout, or with stream a sequence\n"
+        << "                                          of frames, each prefixed by its size as 64-bit big-endian\n"
+        << "  --format=png|ppm|pam|qoi|raw-planar|raw-interleaved\n"
+        << "                                          output format (default png); raw images get a .json sidecar\n"
+        << "  --input-io=mmap|stdio                   read inputs through a memory mapping (default) or buffered reads\n"
+        << "  --input-tar=PATH --output-tar=PATH      blur the members of a tar archive into another archive, in order\n"
+        << "  --durability=none|file|group            outputs are always written to a temporary and renamed; file also\n"
+        << "                                          fsyncs each one, group runs one syncfs per group of outputs\n"
+        << "  --group-commit-files=N                  outputs per group commit (default 256)\n"
+        << "  --group-commit-ms=T                     longest wait before a partial group is synced (default 1000)\n"
+        << "  --output-store=DIR                      append outputs to segment files in DIR instead of one file each,\n"
+        << "                                          read them back with box_blur_pack\n"
+        << "  --store-segment-size=BYTES              start a new segment past this size (default 1G)\n"
+        << "  --threads=N                             worker threads blurring images (default: tuned, or all cores)\n"
+        << "  --queue-size=N                          inputs read ahead of the workers (default: twice the workers)\n"
+        << "  --autotune                              time the kernels, tile shapes and thread splits on images sized\n"
+        << "                                          like the inputs, save the fastest to the tuning profile and exit\n"
+        << "  --tuning-profile=PATH                   profile loaded at startup and re-tuned when the CPU model changes\n"
+        << "                                          (default ~/.cache/box_blur/tuning-<hostname>)\n"
+        << "  --scan-threads=N                        threads enumerating the input tree (default: up to 4)\n"
+        << "  --incremental                           only process inputs that are new, changed or need other parameters\n"
+        << "                                          than recorded in <output-dir>/" << MANIFEST_FILENAME << "\n"
+        << "  --cache-dir=PATH                        reuse outputs of identical inputs and parameters from PATH\n"
+        << "  --cache-size=BYTES                      evict least recently used cache entries above this size (e.g. 20G)\n"
+        << "  --png-preset=stb|fastest|balanced|smallest\n"
+        << "                                          encoder preset (default stb: level 8, adaptive filter)\n"
+        << "  --png-level=0..9                        override the preset zlib level (0 = stored)\n"
+        << "  --png-filter=adaptive|none|sub|up|average|paeth\n"
+        << "                                          override the preset row filter\n"
+        << "  --png-compare                           also encode every image with each preset and report the cost\n"
+        << "  --deflate-threads=N                     threads deflating one large PNG (default: all cores\n"
+        << "                                          with --stdio or --threads=1, else 1)\n"
+        << "  --stage-rows=PATH                       write the time of every stage per image to PATH, as JSON if it\n"
+        << "                                          ends in .json and CSV otherwise\n"
+        << "  --latency-interval=SEC                  also print latency percentiles to stderr every SEC seconds\n"
+        << "  --perf-counters                         count cycles, instructions, cache and branch misses per stage\n"
+        << "  --trace=PATH                            record what every thread does and write it to PATH as Chrome\n"
+        << "                                          trace-event JSON on exit and on SIGUSR1 (open in Perfetto)\n"
+        << "  --trace-events=N                        most recent events kept per thread (default 65536)\n"
+        << "  --metrics-port=PORT                     serve Prometheus metrics at http://127.0.0.1:PORT/metrics\n"
+        << "  --metrics-file=PATH                     rewrite Prometheus metrics to PATH every "
+        << METRICS_FILE_INTERVAL.count() << " seconds, for the\n"
+        << "                                          node_exporter textfile collector\n";
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+#include "batch.h"
+
+// How often --metrics-file is rewritten
+static const std::chrono::seconds METRICS_FILE_INTERVAL(5);
+
+// Everything one run of box_blur is told. parse_config builds and validates it once
+// at startup; from then on it is only read.
+struct config_t
+{
+    batch_options_t batch;
+    // Set explicitly, a tuning profile does not override them
+    bool threads_set = false;
+    bool kernel_set = false;
+    unsigned deflate_threads = 0; // 0 keeps the codec default
+    bool stdio = false;
+    bool stdio_stream = false;
+    std::string input_tar;
+    std::string output_tar;
+    std::string stage_rows;
+    int latency_interval = 0;
+    std::string trace_path;
+    size_t trace_events = 1 << 16;
+    int metrics_port = 0;
+    std::string metrics_file;
+    bool autotune = false;
+    std::string tuning_path;
+    bool help = false; // --help or -h, nothing else is parsed
+};
+
+// Options from the file named by --config, if any, overridden by the command line.
+// Config files hold one option per line without the leading dashes, as
+// "radius = 3" or "incremental"; # starts a comment. Throws invalid_argument for
+// unknown, malformed or contradicting options, unless --help asks for the usage.
+config_t parse_config(int argc, char *argv[]);
+
+void print_usage(std::ostream &out, const char *program);
+
+// The whole of value as an int, throws invalid_argument for anything else
+int parse_number(const std::string &value);
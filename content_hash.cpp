@@ -0,0 +1,148 @@
+#include "content_hash.h"
+
+#include <cstring>
+
+using namespace std;
+
+static const uint64_t PRIME64_1 = 11400714785074694791ULL;
+static const uint64_t PRIME64_2 = 14029467366897019727ULL;
+static const uint64_t PRIME64_3 = 1609587929392839161ULL;
+static const uint64_t PRIME64_4 = 9650029242287828579ULL;
+static const uint64_t PRIME64_5 = 2870177450012600261ULL;
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void xxh64_init(uint64_t seed, uint64_t v[4])
+{
+    v[0] = seed + PRIME64_1 + PRIME64_2;
+    v[1] = seed + PRIME64_2;
+    v[2] = seed;
+    v[3] = seed - PRIME64_1;
+}
+
+// Everything after the 32-byte stripes: p to end is what the stripes left over
+static uint64_t xxh64_finish(const uint64_t v[4], uint64_t seed, const unsigned char *p, const unsigned char *end, size_t length)
+{
+    uint64_t h;
+    if (length >= 32)
+    {
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        h = xxh64_merge(h, v[0]);
+        h = xxh64_merge(h, v[1]);
+        h = xxh64_merge(h, v[2]);
+        h = xxh64_merge(h, v[3]);
+    }
+    else
+    {
+        h = seed + PRIME64_5;
+    }
+
+    h += length;
+    for (; end - p >= 8; p += 8)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (end - p >= 4)
+    {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        h ^= *p * PRIME64_5;
+        h = rotl(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + length;
+    uint64_t v[4];
+    xxh64_init(seed, v);
+    for (; end - p >= 32; p += 32)
+    {
+        v[0] = xxh64_round(v[0], read64(p));
+        v[1] = xxh64_round(v[1], read64(p + 8));
+        v[2] = xxh64_round(v[2], read64(p + 16));
+        v[3] = xxh64_round(v[3], read64(p + 24));
+    }
+    return xxh64_finish(v, seed, p, end, length);
+}
+
+content_digest_t content_digest(const void *data, size_t length)
+{
+    // Both seeds ride the same pass, each input word is loaded once for the two lanes
+    static const uint64_t SEEDS[2] = {0, ~uint64_t(0)};
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + length;
+    uint64_t a[4], b[4];
+    xxh64_init(SEEDS[0], a);
+    xxh64_init(SEEDS[1], b);
+    for (; end - p >= 32; p += 32)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            uint64_t word = read64(p + 8 * i);
+            a[i] = xxh64_round(a[i], word);
+            b[i] = xxh64_round(b[i], word);
+        }
+    }
+    return {{xxh64_finish(a, SEEDS[0], p, end, length), xxh64_finish(b, SEEDS[1], p, end, length)}};
+}
+
+string content_key(const content_digest_t &digest, const string &context)
+{
+    uint64_t seed = xxh64(context.data(), context.size());
+    uint64_t parts[2] = {xxh64(digest.parts, sizeof digest.parts, seed), xxh64(digest.parts, sizeof digest.parts, ~seed)};
+
+    static const char HEX[] = "0123456789abcdef";
+    string key;
+    for (uint64_t part : parts)
+    {
+        for (int shift = 60; shift >= 0; shift -= 4)
+        {
+            key += HEX[(part >> shift) & 0xf];
+        }
+    }
+    return key;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// XXH64 of data, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+uint64_t xxh64(const void *data, size_t length, uint64_t seed = 0);
+
+// 128 bits of content: XXH64 of data with seed 0, which is plain xxh64(), and with ~0
+struct content_digest_t
+{
+    uint64_t parts[2];
+};
+
+// Reads data once for both parts, for the manifest and the result cache alike
+content_digest_t content_digest(const void *data, size_t length);
+
+// 128-bit content key as 32 hex digits: the digest hashed twice with seeds from the hash
+// of context, so the same bytes under different parameters get different keys
+std::string content_key(const content_digest_t &digest, const std::string &context);
@@ -0,0 +1,192 @@
+#include "directory_scanner.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace_recorder.h"
+
+using namespace std;
+
+// One getdents64 call returns this much directory data, a few thousand entries
+static const size_t DIRENT_BUFFER_SIZE = 1 << 20;
+
+struct linux_dirent64_t
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+size_t scan_directory_tree(const string &root, unsigned num_threads, const function<void(const string &)> &on_file, const vector<string> &skip)
+{
+    // Directories that do not exist yet cannot be inside the tree either
+    vector<pair<dev_t, ino_t>> skipped;
+    for (const string &directory : skip)
+    {
+        struct stat st;
+        if (!directory.empty() && stat(directory.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            skipped.emplace_back(st.st_dev, st.st_ino);
+        }
+    }
+    auto is_skipped = [&](const string &path, ino64_t inode)
+    {
+        for (auto [device, skipped_inode] : skipped)
+        {
+            struct stat st;
+            // d_ino is enough to rule a directory out, stat only for the candidates
+            if (inode == skipped_inode && stat(path.c_str(), &st) == 0 && st.st_dev == device && st.st_ino == skipped_inode)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    mutex state_mutex;
+    condition_variable ready;
+    vector<string> directories = {root};
+    // Directories queued or being read; the scan is over when it drops to zero
+    size_t pending = 1;
+    size_t failures = 0;
+    exception_ptr error;
+
+    auto scan = [&]()
+    {
+        vector<char> buffer(DIRENT_BUFFER_SIZE);
+        unique_lock<mutex> lock(state_mutex);
+        for (;;)
+        {
+            ready.wait(lock, [&] { return !directories.empty() || pending == 0 || error; });
+            if (directories.empty())
+            {
+                return;
+            }
+            string directory = move(directories.back());
+            directories.pop_back();
+            lock.unlock();
+
+            vector<string> subdirectories;
+            int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            bool failed = fd < 0;
+            if (failed)
+            {
+                cerr << "Error, cannot read directory " + directory + ": " + strerror(errno) + "\n";
+            }
+            try
+            {
+                long n = 0;
+                for (; fd >= 0 && (n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0;)
+                {
+                    for (long offset = 0; offset < n;)
+                    {
+                        auto *entry = reinterpret_cast<linux_dirent64_t *>(buffer.data() + offset);
+                        offset += entry->d_reclen;
+                        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                        {
+                            continue;
+                        }
+
+                        string path = directory + "/" + entry->d_name;
+                        unsigned char type = entry->d_type;
+                        if (type == DT_UNKNOWN || type == DT_LNK)
+                        {
+                            // Some filesystems leave d_type empty; links are resolved but only to files
+                            struct stat st;
+                            bool link = type == DT_LNK;
+                            if (stat(path.c_str(), &st) != 0)
+                            {
+                                continue;
+                            }
+                            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) && !link ? DT_DIR : DT_UNKNOWN;
+                        }
+
+                        if (type == DT_DIR)
+                        {
+                            if (!is_skipped(path, entry->d_ino))
+                            {
+                                subdirectories.push_back(move(path));
+                            }
+                        }
+                        else if (type == DT_REG)
+                        {
+                            on_file(path);
+                        }
+                    }
+                }
+                if (n < 0)
+                {
+                    // The entries past the error are lost, which the run has to report
+                    cerr << "Error, cannot read directory " + directory + ": " + strerror(errno) + "\n";
+                    failed = true;
+                }
+            }
+            catch (...)
+            {
+                lock.lock();
+                if (!error)
+                {
+                    error = current_exception();
+                }
+                lock.unlock();
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            lock.lock();
+            failures += failed;
+            if (!error)
+            {
+                pending += subdirectories.size();
+                for (string &subdirectory : subdirectories)
+                {
+                    directories.push_back(move(subdirectory));
+                }
+            }
+            else
+            {
+                // Abandon the rest of the tree
+                pending -= directories.size();
+                directories.clear();
+            }
+            pending--;
+            ready.notify_all();
+        }
+    };
+
+    vector<thread> threads;
+    for (unsigned t = 1; t < max(1u, num_threads); ++t)
+    {
+        threads.emplace_back([&, t]()
+                             {
+                                 trace_thread_name("scanner " + to_string(t));
+                                 scan(); });
+    }
+    scan();
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+    return failures;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Walks the tree below root on num_threads threads and calls on_file with the path
+// (root + "/" + relative path) of every regular file as soon as its directory batch
+// is read, so consumers start before the scan ends. Directories are read with large
+// getdents64 batches; symlinks to files are reported, symlinked directories are not
+// followed. on_file is called concurrently and may block to apply backpressure.
+// Directories in skip (any spelling of them, compared by inode) are left out, like
+// an output directory inside the input tree.
+// Returns the number of directories that could not be read completely.
+size_t scan_directory_tree(const std::string &root, unsigned num_threads, const std::function<void(const std::string &)> &on_file,
+                           const std::vector<std::string> &skip = {});
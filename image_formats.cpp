@@ -0,0 +1,529 @@
+#include "image_formats.h"
+
+#include <array>
+#include <cctype>
+#include <filesystem>
+#include <stdexcept>
+
+using namespace std;
+
+// QOI opcodes, see https://qoiformat.org/qoi-specification.pdf
+static const uint8_t QOI_OP_INDEX = 0x00;
+static const uint8_t QOI_OP_DIFF = 0x40;
+static const uint8_t QOI_OP_LUMA = 0x80;
+static const uint8_t QOI_OP_RUN = 0xc0;
+static const uint8_t QOI_OP_RGB = 0xfe;
+static const uint8_t QOI_OP_RGBA = 0xff;
+static const uint8_t QOI_MASK = 0xc0;
+static const size_t QOI_HEADER_SIZE = 14;
+// Longest run one QOI_OP_RUN byte encodes, and so the most pixels any byte produces
+static const int QOI_MAX_RUN = 62;
+static const uint8_t QOI_PADDING[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static const image_format_t IMAGE_FORMATS[] = {image_format_t::png, image_format_t::ppm, image_format_t::pam,
+                                               image_format_t::qoi, image_format_t::raw_planar, image_format_t::raw_interleaved};
+
+string to_string(image_format_t format)
+{
+    switch (format)
+    {
+    case image_format_t::png:
+        return "png";
+    case image_format_t::ppm:
+        return "ppm";
+    case image_format_t::pam:
+        return "pam";
+    case image_format_t::qoi:
+        return "qoi";
+    case image_format_t::raw_planar:
+        return "raw-planar";
+    case image_format_t::raw_interleaved:
+        return "raw-interleaved";
+    }
+    return "unknown";
+}
+
+image_format_t parse_image_format(const string &name)
+{
+    for (image_format_t format : IMAGE_FORMATS)
+    {
+        if (to_string(format) == name)
+        {
+            return format;
+        }
+    }
+    throw invalid_argument("Unknown image format " + name);
+}
+
+string extension(image_format_t format)
+{
+    switch (format)
+    {
+    case image_format_t::png:
+        return ".png";
+    case image_format_t::ppm:
+        return ".ppm";
+    case image_format_t::pam:
+        return ".pam";
+    case image_format_t::qoi:
+        return ".qoi";
+    case image_format_t::raw_planar:
+    case image_format_t::raw_interleaved:
+        return ".raw";
+    }
+    return "";
+}
+
+image_format_t format_from_path(const string &path)
+{
+    string ext = filesystem::path(path).extension().string();
+    for (char &c : ext)
+    {
+        c = tolower(c);
+    }
+    if (ext == ".ppm" || ext == ".pgm")
+    {
+        return image_format_t::ppm;
+    }
+    if (ext == ".pam")
+    {
+        return image_format_t::pam;
+    }
+    if (ext == ".qoi")
+    {
+        return image_format_t::qoi;
+    }
+    if (ext == ".raw")
+    {
+        // The layout is read from the sidecar
+        return image_format_t::raw_interleaved;
+    }
+    return image_format_t::png;
+}
+
+string raw_sidecar_path(const string &path)
+{
+    return path + ".json";
+}
+
+static void append(vector<unsigned char> &out, const string &text)
+{
+    out.insert(out.end(), text.begin(), text.end());
+}
+
+static void append_be32(vector<unsigned char> &out, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        out.push_back((value >> shift) & 0xff);
+    }
+}
+
+vector<unsigned char> encode_ppm(const pixel_buffer_t &image)
+{
+    if (image.channels != 1 && image.channels != 3)
+    {
+        throw invalid_argument("PPM needs 1 or 3 channels, got " + to_string(image.channels));
+    }
+    vector<unsigned char> out;
+    out.reserve(image.pixels.size() + 32);
+    append(out, string(image.channels == 1 ? "P5" : "P6") + "\n" + to_string(image.width) + " " + to_string(image.height) + "\n255\n");
+    out.insert(out.end(), image.pixels.begin(), image.pixels.end());
+    return out;
+}
+
+vector<unsigned char> encode_pam(const pixel_buffer_t &image)
+{
+    static const char *TUPLE_TYPES[] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+    if (image.channels < 1 || image.channels > 4)
+    {
+        throw invalid_argument("PAM needs 1 to 4 channels, got " + to_string(image.channels));
+    }
+    vector<unsigned char> out;
+    out.reserve(image.pixels.size() + 96);
+    append(out, "P7\nWIDTH " + to_string(image.width) + "\nHEIGHT " + to_string(image.height) + "\nDEPTH " + to_string(image.channels) +
+                    "\nMAXVAL 255\nTUPLTYPE " + TUPLE_TYPES[image.channels - 1] + "\nENDHDR\n");
+    out.insert(out.end(), image.pixels.begin(), image.pixels.end());
+    return out;
+}
+
+static int qoi_hash(const array<uint8_t, 4> &px)
+{
+    return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+}
+
+vector<unsigned char> encode_qoi(const pixel_buffer_t &image)
+{
+    if (image.channels != 3 && image.channels != 4)
+    {
+        throw invalid_argument("QOI needs 3 or 4 channels, got " + to_string(image.channels));
+    }
+
+    vector<unsigned char> out;
+    out.reserve(QOI_HEADER_SIZE + image.pixels.size() + sizeof(QOI_PADDING));
+    append(out, "qoif");
+    append_be32(out, image.width);
+    append_be32(out, image.height);
+    out.push_back(image.channels);
+    out.push_back(0); // sRGB with linear alpha
+
+    // 3 or 4 as checked above, spelled so the compiler sees px cannot overflow
+    const int channels = image.channels == 4 ? 4 : 3;
+    array<array<uint8_t, 4>, 64> index{};
+    array<uint8_t, 4> prev = {0, 0, 0, 255};
+    array<uint8_t, 4> px = prev;
+    int run = 0;
+    size_t length = image.pixels.size();
+    for (size_t pos = 0; pos < length; pos += channels)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            px[c] = image.pixels[pos + c];
+        }
+
+        if (px == prev)
+        {
+            run++;
+            if (run == QOI_MAX_RUN || pos + channels == length)
+            {
+                out.push_back(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0)
+        {
+            out.push_back(QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        int hash = qoi_hash(px);
+        if (index[hash] == px)
+        {
+            out.push_back(QOI_OP_INDEX | hash);
+        }
+        else
+        {
+            index[hash] = px;
+            if (px[3] == prev[3])
+            {
+                int8_t vr = px[0] - prev[0];
+                int8_t vg = px[1] - prev[1];
+                int8_t vb = px[2] - prev[2];
+                int8_t vg_r = vr - vg;
+                int8_t vg_b = vb - vg;
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                {
+                    out.push_back(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                }
+                else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+                {
+                    out.push_back(QOI_OP_LUMA | (vg + 32));
+                    out.push_back((vg_r + 8) << 4 | (vg_b + 8));
+                }
+                else
+                {
+                    out.push_back(QOI_OP_RGB);
+                    out.insert(out.end(), px.begin(), px.begin() + 3);
+                }
+            }
+            else
+            {
+                out.push_back(QOI_OP_RGBA);
+                out.insert(out.end(), px.begin(), px.end());
+            }
+        }
+        prev = px;
+    }
+    out.insert(out.end(), begin(QOI_PADDING), end(QOI_PADDING));
+    return out;
+}
+
+vector<unsigned char> encode_raw(const pixel_buffer_t &image, bool planar)
+{
+    if (!planar)
+    {
+        return vector<unsigned char>(image.pixels.begin(), image.pixels.end());
+    }
+    size_t plane = static_cast<size_t>(image.width) * image.height;
+    vector<unsigned char> out(image.pixels.size());
+    for (int c = 0; c < image.channels; ++c)
+    {
+        for (size_t i = 0; i < plane; ++i)
+        {
+            out[c * plane + i] = image.pixels[i * image.channels + c];
+        }
+    }
+    return out;
+}
+
+string encode_raw_sidecar(const pixel_buffer_t &image, bool planar)
+{
+    return "{\"width\": " + to_string(image.width) + ", \"height\": " + to_string(image.height) + ", \"channels\": " +
+           to_string(image.channels) + ", \"layout\": \"" + (planar ? "planar" : "interleaved") + "\", \"dtype\": \"uint8\"}\n";
+}
+
+// Reads the next header token of a P5/P6 file, skipping whitespace and comments
+static string netpbm_token(const unsigned char *data, size_t length, size_t &pos)
+{
+    while (pos < length && (isspace(data[pos]) || data[pos] == '#'))
+    {
+        if (data[pos] == '#')
+        {
+            while (pos < length && data[pos] != '\n')
+            {
+                pos++;
+            }
+        }
+        else
+        {
+            pos++;
+        }
+    }
+    size_t start = pos;
+    while (pos < length && !isspace(data[pos]))
+    {
+        pos++;
+    }
+    return string(reinterpret_cast<const char *>(data + start), pos - start);
+}
+
+static int positive_int(const string &text, const char *what)
+{
+    size_t used = 0;
+    int value = 0;
+    try
+    {
+        value = stoi(text, &used);
+    }
+    catch (const exception &)
+    {
+    }
+    if (used != text.size() || value <= 0)
+    {
+        throw runtime_error(string("Invalid ") + what + " '" + text + "'");
+    }
+    return value;
+}
+
+pixel_buffer_t decode_netpbm(const unsigned char *data, size_t length)
+{
+    size_t pos = 0;
+    string magic = netpbm_token(data, length, pos);
+    pixel_buffer_t image;
+    int maxval = 0;
+
+    if (magic == "P5" || magic == "P6")
+    {
+        image.width = positive_int(netpbm_token(data, length, pos), "width");
+        image.height = positive_int(netpbm_token(data, length, pos), "height");
+        maxval = positive_int(netpbm_token(data, length, pos), "maxval");
+        image.channels = magic == "P5" ? 1 : 3;
+    }
+    else if (magic == "P7")
+    {
+        for (string key = netpbm_token(data, length, pos); key != "ENDHDR"; key = netpbm_token(data, length, pos))
+        {
+            if (key.empty())
+            {
+                throw runtime_error("Truncated PAM header");
+            }
+            string value = netpbm_token(data, length, pos);
+            if (key == "WIDTH")
+            {
+                image.width = positive_int(value, "width");
+            }
+            else if (key == "HEIGHT")
+            {
+                image.height = positive_int(value, "height");
+            }
+            else if (key == "DEPTH")
+            {
+                image.channels = positive_int(value, "depth");
+            }
+            else if (key == "MAXVAL")
+            {
+                maxval = positive_int(value, "maxval");
+            }
+        }
+        if (!image.width || !image.height || image.channels < 1 || image.channels > 4)
+        {
+            throw runtime_error("Incomplete PAM header");
+        }
+    }
+    else
+    {
+        throw runtime_error("Not a binary Netpbm image");
+    }
+
+    if (maxval != 255)
+    {
+        throw runtime_error("Only 8-bit Netpbm images are supported");
+    }
+
+    // Exactly one whitespace byte separates the header from the pixels
+    pos++;
+    size_t size = static_cast<size_t>(image.width) * image.height * image.channels;
+    if (pos > length || length - pos < size)
+    {
+        throw runtime_error("Truncated Netpbm image");
+    }
+    image.pixels.assign(data + pos, data + pos + size);
+    return image;
+}
+
+pixel_buffer_t decode_qoi(const unsigned char *data, size_t length)
+{
+    if (length < QOI_HEADER_SIZE + sizeof(QOI_PADDING) || string(reinterpret_cast<const char *>(data), 4) != "qoif")
+    {
+        throw runtime_error("Not a QOI image");
+    }
+    auto be32 = [&](size_t at)
+    { return static_cast<uint32_t>(data[at]) << 24 | data[at + 1] << 16 | data[at + 2] << 8 | data[at + 3]; };
+
+    pixel_buffer_t image;
+    uint32_t width = be32(4);
+    uint32_t height = be32(8);
+    image.channels = data[12];
+    if (width == 0 || height == 0 || width > 1u << 30 || height > (1u << 30) / width ||
+        (image.channels != 3 && image.channels != 4))
+    {
+        throw runtime_error("Invalid QOI header");
+    }
+    // Checked before allocating, so a short file cannot claim a huge image
+    if (static_cast<uint64_t>(width) * height > static_cast<uint64_t>(length - QOI_HEADER_SIZE - sizeof(QOI_PADDING)) * QOI_MAX_RUN)
+    {
+        throw runtime_error("Truncated QOI image");
+    }
+    image.width = width;
+    image.height = height;
+    image.pixels.resize(static_cast<size_t>(width) * height * image.channels);
+
+    array<array<uint8_t, 4>, 64> index{};
+    array<uint8_t, 4> px = {0, 0, 0, 255};
+    size_t pos = QOI_HEADER_SIZE;
+    size_t end = length - sizeof(QOI_PADDING);
+    int run = 0;
+    for (size_t out = 0; out < image.pixels.size(); out += image.channels)
+    {
+        if (run > 0)
+        {
+            run--;
+        }
+        else if (pos < end)
+        {
+            uint8_t b1 = data[pos++];
+            if (b1 == QOI_OP_RGB)
+            {
+                if (end - pos < 3)
+                {
+                    throw runtime_error("Truncated QOI image");
+                }
+                px[0] = data[pos++];
+                px[1] = data[pos++];
+                px[2] = data[pos++];
+            }
+            else if (b1 == QOI_OP_RGBA)
+            {
+                if (end - pos < 4)
+                {
+                    throw runtime_error("Truncated QOI image");
+                }
+                px[0] = data[pos++];
+                px[1] = data[pos++];
+                px[2] = data[pos++];
+                px[3] = data[pos++];
+            }
+            else if ((b1 & QOI_MASK) == QOI_OP_INDEX)
+            {
+                px = index[b1];
+            }
+            else if ((b1 & QOI_MASK) == QOI_OP_DIFF)
+            {
+                px[0] += ((b1 >> 4) & 0x03) - 2;
+                px[1] += ((b1 >> 2) & 0x03) - 2;
+                px[2] += (b1 & 0x03) - 2;
+            }
+            else if ((b1 & QOI_MASK) == QOI_OP_LUMA)
+            {
+                if (pos == end)
+                {
+                    throw runtime_error("Truncated QOI image");
+                }
+                uint8_t b2 = data[pos++];
+                int vg = (b1 & 0x3f) - 32;
+                px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+                px[1] += vg;
+                px[2] += vg - 8 + (b2 & 0x0f);
+            }
+            else
+            {
+                run = b1 & 0x3f;
+            }
+            index[qoi_hash(px)] = px;
+        }
+        else
+        {
+            throw runtime_error("Truncated QOI image");
+        }
+
+        for (int c = 0; c < image.channels; ++c)
+        {
+            image.pixels[out + c] = px[c];
+        }
+    }
+    return image;
+}
+
+// Value of a top-level key in the flat JSON object written by encode_raw_sidecar
+static string json_field(const string &json, const string &key)
+{
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == string::npos || (pos = json.find(':', pos)) == string::npos)
+    {
+        throw runtime_error("Raw sidecar is missing \"" + key + "\"");
+    }
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos != string::npos && json[pos] == '"')
+    {
+        size_t end = json.find('"', pos + 1);
+        return json.substr(pos + 1, end - pos - 1);
+    }
+    size_t end = json.find_first_of(",} \t\r\n", pos);
+    return json.substr(pos, end - pos);
+}
+
+pixel_buffer_t decode_raw(const unsigned char *data, size_t length, const string &sidecar)
+{
+    pixel_buffer_t image;
+    image.width = positive_int(json_field(sidecar, "width"), "width");
+    image.height = positive_int(json_field(sidecar, "height"), "height");
+    image.channels = positive_int(json_field(sidecar, "channels"), "channels");
+    string layout = json_field(sidecar, "layout");
+    if (json_field(sidecar, "dtype") != "uint8" || (layout != "planar" && layout != "interleaved"))
+    {
+        throw runtime_error("Unsupported raw layout " + layout);
+    }
+
+    size_t plane = static_cast<size_t>(image.width) * image.height;
+    if (length != plane * image.channels)
+    {
+        throw runtime_error("Raw image size does not match its sidecar");
+    }
+
+    if (layout == "interleaved")
+    {
+        image.pixels.assign(data, data + length);
+        return image;
+    }
+    image.pixels.resize(length);
+    for (int c = 0; c < image.channels; ++c)
+    {
+        for (size_t i = 0; i < plane; ++i)
+        {
+            image.pixels[i * image.channels + c] = data[c * plane + i];
+        }
+    }
+    return image;
+}
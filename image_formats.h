@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Interleaved 8-bit pixels as handed to or produced by a codec
+struct pixel_buffer_t
+{
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    std::vector<uint8_t> pixels;
+};
+
+enum class image_format_t
+{
+    png,
+    ppm,             // binary PPM (P6), or PGM (P5) for one channel
+    pam,             // Netpbm PAM (P7)
+    qoi,             // Quite OK Image format
+    raw_planar,      // headerless channel planes, described by a JSON sidecar
+    raw_interleaved  // headerless interleaved pixels, described by a JSON sidecar
+};
+
+std::string to_string(image_format_t format);
+image_format_t parse_image_format(const std::string &name);
+
+// File extension written for the format, including the dot
+std::string extension(image_format_t format);
+
+// Format guessed from the file extension; anything unknown is png and goes through stb
+image_format_t format_from_path(const std::string &path);
+
+// Path of the JSON sidecar describing a raw image
+std::string raw_sidecar_path(const std::string &path);
+
+std::vector<unsigned char> encode_ppm(const pixel_buffer_t &image);
+std::vector<unsigned char> encode_pam(const pixel_buffer_t &image);
+std::vector<unsigned char> encode_qoi(const pixel_buffer_t &image);
+std::vector<unsigned char> encode_raw(const pixel_buffer_t &image, bool planar);
+std::string encode_raw_sidecar(const pixel_buffer_t &image, bool planar);
+
+// Decodes P5, P6 and P7 files
+pixel_buffer_t decode_netpbm(const unsigned char *data, size_t length);
+pixel_buffer_t decode_qoi(const unsigned char *data, size_t length);
+pixel_buffer_t decode_raw(const unsigned char *data, size_t length, const std::string &sidecar);
@@ -0,0 +1,90 @@
+#include "kernel_check.h"
+
+#include <cstdlib>
+#include <random>
+
+using namespace std;
+
+string check_kernel(const kernel_variant_t &kernel, const single_channel_image_t &image, int filter_size)
+{
+    single_channel_image_t expected = apply_box_blur(image, filter_size);
+    single_channel_image_t actual = kernel.run(image, filter_size);
+    if (actual.size() != expected.size() || (!actual.empty() && actual[0].size() != expected[0].size()))
+    {
+        return "result is " + to_string(actual.empty() ? 0 : actual[0].size()) + "x" + to_string(actual.size()) + ", expected " +
+               to_string(expected[0].size()) + "x" + to_string(expected.size());
+    }
+    for (size_t y = 0; y < expected.size(); ++y)
+    {
+        if (actual[y].size() != expected[y].size())
+        {
+            return "row " + to_string(y) + " has " + to_string(actual[y].size()) + " pixels, expected " + to_string(expected[y].size());
+        }
+        for (size_t x = 0; x < expected[y].size(); ++x)
+        {
+            if (abs(actual[y][x] - expected[y][x]) > kernel.tolerance)
+            {
+                return "pixel (" + to_string(x) + ", " + to_string(y) + ") is " + to_string(actual[y][x]) + ", expected " + to_string(expected[y][x]);
+            }
+        }
+    }
+    return "";
+}
+
+const char *to_string(test_pattern_t pattern)
+{
+    switch (pattern)
+    {
+    case test_pattern_t::random:
+        return "random";
+    case test_pattern_t::black:
+        return "black";
+    case test_pattern_t::white:
+        return "white";
+    case test_pattern_t::checkerboard:
+        return "checkerboard";
+    case test_pattern_t::gradient:
+        return "gradient";
+    case test_pattern_t::impulse:
+        return "impulse";
+    case test_pattern_t::count:
+        break;
+    }
+    return "unknown";
+}
+
+single_channel_image_t make_test_image(test_pattern_t pattern, int width, int height, uint32_t seed)
+{
+    single_channel_image_t image(height, vector<uint8_t>(width));
+    mt19937 random(seed);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            switch (pattern)
+            {
+            case test_pattern_t::random:
+                image[y][x] = random();
+                break;
+            case test_pattern_t::black:
+            case test_pattern_t::impulse:
+            case test_pattern_t::count:
+                break;
+            case test_pattern_t::white:
+                image[y][x] = 255;
+                break;
+            case test_pattern_t::checkerboard:
+                image[y][x] = (x + y) % 2 ? 255 : 0;
+                break;
+            case test_pattern_t::gradient:
+                image[y][x] = (x * 7 + y * 13) % 256;
+                break;
+            }
+        }
+    }
+    if (pattern == test_pattern_t::impulse)
+    {
+        image[height / 2][width / 2] = 255;
+    }
+    return image;
+}
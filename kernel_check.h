@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "blur.h"
+
+// Runs kernel and the reference on image and compares the results. Returns an
+// empty string if they agree within the kernel's tolerance, otherwise where and
+// how they differ.
+std::string check_kernel(const kernel_variant_t &kernel, const single_channel_image_t &image, int filter_size);
+
+// Test images for check_kernel
+enum class test_pattern_t
+{
+    random,
+    black,
+    white,
+    checkerboard,
+    gradient,
+    impulse, // a single white pixel on black
+    count
+};
+
+const char *to_string(test_pattern_t pattern);
+
+single_channel_image_t make_test_image(test_pattern_t pattern, int width, int height, uint32_t seed);
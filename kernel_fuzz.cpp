@@ -0,0 +1,42 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "kernel_check.h"
+
+using namespace std;
+
+// libFuzzer entry point checking every kernel variant against the reference on
+// images and filter sizes taken from the fuzzer input
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < 3)
+    {
+        return 0;
+    }
+    // Small images keep the reference cheap enough for many runs per second
+    int width = 1 + data[0] % 64;
+    int height = 1 + data[1] % 64;
+    int filter_size = 1 + 2 * (data[2] % 16);
+    data += 3;
+    size -= 3;
+
+    single_channel_image_t image(height, vector<uint8_t>(width));
+    for (int y = 0, i = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x, ++i)
+        {
+            image[y][x] = size ? data[i % size] : 0;
+        }
+    }
+
+    for (const kernel_variant_t &kernel : kernel_variants())
+    {
+        string mismatch = check_kernel(kernel, image, filter_size);
+        if (!mismatch.empty())
+        {
+            fprintf(stderr, "%s, %dx%d filter %d: %s\n", kernel.name, width, height, filter_size, mismatch.c_str());
+            abort();
+        }
+    }
+    return 0;
+}
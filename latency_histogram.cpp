@@ -0,0 +1,88 @@
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+size_t latency_histogram_t::bucket_index(uint64_t ns)
+{
+    ns = min(ns, (uint64_t(1) << MAX_VALUE_BITS) - 1);
+    if (ns < (uint64_t(1) << SUB_BUCKET_BITS))
+    {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - SUB_BUCKET_BITS + 1;
+    // ns >> shift keeps SUB_BUCKET_BITS bits with the top one set
+    return (size_t(shift) << (SUB_BUCKET_BITS - 1)) + (ns >> shift);
+}
+
+uint64_t latency_histogram_t::bucket_upper_bound(size_t index)
+{
+    if (index < (size_t(1) << SUB_BUCKET_BITS))
+    {
+        return index;
+    }
+    int shift = int(index >> (SUB_BUCKET_BITS - 1)) - 1;
+    uint64_t mantissa = index - (size_t(shift) << (SUB_BUCKET_BITS - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void latency_histogram_t::record(uint64_t ns)
+{
+    counts_[bucket_index(ns)].fetch_add(1, memory_order_relaxed);
+    count_.fetch_add(1, memory_order_relaxed);
+    uint64_t current = max_.load(memory_order_relaxed);
+    while (ns > current && !max_.compare_exchange_weak(current, ns, memory_order_relaxed))
+    {
+    }
+}
+
+void latency_histogram_t::add(const latency_histogram_t &other)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        uint64_t n = other.counts_[i].load(memory_order_relaxed);
+        counts_[i].fetch_add(n, memory_order_relaxed);
+        total += n;
+    }
+    // Summed from the buckets so percentiles stay consistent with a concurrent recorder
+    count_.fetch_add(total, memory_order_relaxed);
+    uint64_t other_max = other.max();
+    uint64_t current = max_.load(memory_order_relaxed);
+    while (other_max > current && !max_.compare_exchange_weak(current, other_max, memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t latency_histogram_t::count_at_or_below(uint64_t ns) const
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS && bucket_upper_bound(i) <= ns; ++i)
+    {
+        total += counts_[i].load(memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t latency_histogram_t::percentile(double percent) const
+{
+    uint64_t total = count();
+    if (!total)
+    {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, ceil(percent / 100 * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        seen += counts_[i].load(memory_order_relaxed);
+        if (seen >= rank)
+        {
+            return min(bucket_upper_bound(i), max());
+        }
+    }
+    return max();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram of nanosecond latencies in the style of HdrHistogram. Values
+// below 2^SUB_BUCKET_BITS get a bucket each, every power of two above is split into
+// 2^(SUB_BUCKET_BITS - 1) linear buckets, so percentiles are reported within about
+// 3% of the recorded value. Counts are relaxed atomics: one thread records while
+// reporters read concurrently without locks.
+class latency_histogram_t
+{
+public:
+    static const int SUB_BUCKET_BITS = 6;
+    // Larger values (above 4.8 hours) are counted in the last bucket
+    static const int MAX_VALUE_BITS = 44;
+    static const size_t BUCKETS = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 2) << (SUB_BUCKET_BITS - 1);
+
+    void record(uint64_t ns);
+
+    // Adds the counts of other, which may still be recording
+    void add(const latency_histogram_t &other);
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    // Highest value of the bucket holding the given percentile (0..100), 0 if empty
+    uint64_t percentile(double percent) const;
+
+    // Values in buckets that end at or below ns
+    uint64_t count_at_or_below(uint64_t ns) const;
+
+    static size_t bucket_index(uint64_t ns);
+    static uint64_t bucket_upper_bound(size_t index);
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> max_{0};
+};
@@ -0,0 +1,192 @@
+#include "manifest.h"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "content_hash.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+// Paths are escaped so every record stays on one tab-separated line
+static string escape(const string &text)
+{
+    string out;
+    for (char c : text)
+    {
+        if (c == '\\')
+        {
+            out += "\\\\";
+        }
+        else if (c == '\t')
+        {
+            out += "\\t";
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out;
+}
+
+static string unescape(const string &text)
+{
+    string out;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        if (text[i] == '\\' && i + 1 < text.size())
+        {
+            char c = text[++i];
+            out += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+        }
+        else
+        {
+            out += text[i];
+        }
+    }
+    return out;
+}
+
+static vector<string> split_tabs(const string &line)
+{
+    vector<string> fields;
+    size_t start = 0;
+    for (size_t tab = line.find('\t'); tab != string::npos; tab = line.find('\t', start))
+    {
+        fields.push_back(line.substr(start, tab - start));
+        start = tab + 1;
+    }
+    fields.push_back(line.substr(start));
+    return fields;
+}
+
+manifest_t::manifest_t(const string &path) : path_(path)
+{
+    ifstream in(path_);
+    string line;
+    while (getline(in, line))
+    {
+        // input, size, mtime, content hash, params hash, output; later lines win
+        vector<string> fields = split_tabs(line);
+        if (fields.size() != 6)
+        {
+            // Torn last line after a crash
+            continue;
+        }
+        try
+        {
+            manifest_record_t record;
+            record.size = stoull(fields[1]);
+            record.mtime_ns = stoll(fields[2]);
+            record.content_hash = stoull(fields[3], nullptr, 16);
+            record.params_hash = stoull(fields[4], nullptr, 16);
+            record.output = unescape(fields[5]);
+            records_[unescape(fields[0])] = record;
+        }
+        catch (const exception &)
+        {
+            continue;
+        }
+    }
+    in.close();
+
+    journal_.open(path_, ios::app);
+    if (!journal_)
+    {
+        throw runtime_error("Failed to open manifest " + path_);
+    }
+}
+
+void manifest_t::stat_input(const string &input, manifest_record_t &record)
+{
+    struct stat st;
+    if (stat(input.c_str(), &st) != 0)
+    {
+        throw runtime_error("Failed to stat " + input + ": " + strerror(errno));
+    }
+    record.size = st.st_size;
+    record.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+bool manifest_t::up_to_date(const string &input, uint64_t params_hash, const string &output)
+{
+    manifest_record_t known;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = records_.find(input);
+        if (it == records_.end())
+        {
+            return false;
+        }
+        known = it->second;
+    }
+    if (known.params_hash != params_hash || known.output != output || !filesystem::exists(output))
+    {
+        return false;
+    }
+
+    manifest_record_t current = known;
+    stat_input(input, current);
+    if (current.size != known.size)
+    {
+        return false;
+    }
+    if (current.mtime_ns == known.mtime_ns)
+    {
+        return true;
+    }
+
+    // Touched but maybe not modified
+    mapped_file_t file(input);
+    if (xxh64(file.data(), file.size()) != known.content_hash)
+    {
+        return false;
+    }
+    record(input, current);
+    return true;
+}
+
+void manifest_t::record(const string &input, const manifest_record_t &record)
+{
+    lock_guard<mutex> lock(mutex_);
+    records_[input] = record;
+    append(input, record);
+    journal_.flush();
+}
+
+void manifest_t::append(const string &input, const manifest_record_t &record)
+{
+    journal_ << escape(input) << '\t' << record.size << '\t' << record.mtime_ns << '\t' << hex << record.content_hash << '\t'
+             << record.params_hash << dec << '\t' << escape(record.output) << '\n';
+}
+
+void manifest_t::compact()
+{
+    lock_guard<mutex> lock(mutex_);
+    journal_.close();
+
+    string temporary = path_ + ".tmp";
+    journal_.open(temporary, ios::trunc);
+    for (const auto &[input, record] : records_)
+    {
+        append(input, record);
+    }
+    journal_.close();
+    if (!journal_)
+    {
+        throw runtime_error("Failed to write manifest " + temporary);
+    }
+    filesystem::rename(temporary, path_);
+    journal_.open(path_, ios::app);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// What was produced from one input, as recorded in the manifest
+struct manifest_record_t
+{
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t content_hash = 0;
+    uint64_t params_hash = 0;
+    std::string output;
+};
+
+// Record of the outputs produced so far, used by --incremental to skip inputs
+// that did not change since the last run. Records are appended to a journal as
+// outputs become durable, so a crash loses at most the images that were in flight
+// or waiting for their group commit;
+// compact() rewrites it with one line per input.
+class manifest_t
+{
+public:
+    explicit manifest_t(const std::string &path);
+
+    // True when input still matches its record for these parameters and the output exists.
+    // A changed mtime with unchanged size falls back to comparing the content hash.
+    bool up_to_date(const std::string &input, uint64_t params_hash, const std::string &output);
+
+    void record(const std::string &input, const manifest_record_t &record);
+
+    // Fills size and mtime of input from stat()
+    static void stat_input(const std::string &input, manifest_record_t &record);
+
+    void compact();
+
+private:
+    void append(const std::string &input, const manifest_record_t &record);
+
+    std::string path_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, manifest_record_t> records_;
+    std::ofstream journal_;
+};
@@ -0,0 +1,80 @@
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+mapped_file_t::mapped_file_t(const string &path) : path_(path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int error = errno;
+        close(fd);
+        throw runtime_error("Failed to stat " + path + ": " + strerror(error));
+    }
+
+    size_ = st.st_size;
+    if (size_ > 0)
+    {
+        void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            int error = errno;
+            close(fd);
+            throw runtime_error("Failed to map " + path + ": " + strerror(error));
+        }
+        data_ = static_cast<unsigned char *>(mapping);
+        // Only hints, a failure just loses the readahead
+        madvise(mapping, size_, MADV_SEQUENTIAL);
+        madvise(mapping, size_, MADV_WILLNEED);
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+mapped_file_t::~mapped_file_t()
+{
+    unmap();
+}
+
+mapped_file_t::mapped_file_t(mapped_file_t &&other) noexcept
+    : path_(move(other.path_)), data_(exchange(other.data_, nullptr)), size_(exchange(other.size_, 0))
+{
+}
+
+mapped_file_t &mapped_file_t::operator=(mapped_file_t &&other) noexcept
+{
+    if (this != &other)
+    {
+        unmap();
+        path_ = move(other.path_);
+        data_ = exchange(other.data_, nullptr);
+        size_ = exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+void mapped_file_t::unmap()
+{
+    if (data_)
+    {
+        munmap(data_, size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+}
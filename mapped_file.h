@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file. Mapping asks the kernel to read
+// the file ahead (MADV_SEQUENTIAL | MADV_WILLNEED), so mapping the next input
+// early overlaps its I/O with the work on the current one.
+class mapped_file_t
+{
+public:
+    mapped_file_t() = default;
+    explicit mapped_file_t(const std::string &path);
+    ~mapped_file_t();
+
+    mapped_file_t(mapped_file_t &&other) noexcept;
+    mapped_file_t &operator=(mapped_file_t &&other) noexcept;
+    mapped_file_t(const mapped_file_t &) = delete;
+    mapped_file_t &operator=(const mapped_file_t &) = delete;
+
+    const unsigned char *data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string &path() const { return path_; }
+
+private:
+    void unmap();
+
+    std::string path_;
+    unsigned char *data_ = nullptr;
+    size_t size_ = 0;
+};
@@ -0,0 +1,239 @@
+#include "metrics.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+// How often the server checks whether it should stop
+static const int ACCEPT_POLL_MS = 200;
+// Slow clients get this long to send their request
+static const int REQUEST_TIMEOUT_MS = 2000;
+
+metric_counter_t &metrics_registry_t::counter(const string &name, const string &help)
+{
+    lock_guard<mutex> lock(mutex_);
+    entries_.push_back({name, help, make_unique<metric_counter_t>(), nullptr});
+    return *entries_.back().counter;
+}
+
+metric_gauge_t &metrics_registry_t::gauge(const string &name, const string &help)
+{
+    lock_guard<mutex> lock(mutex_);
+    entries_.push_back({name, help, nullptr, make_unique<metric_gauge_t>()});
+    return *entries_.back().gauge;
+}
+
+metrics_collector_t metrics_registry_t::collector(function<void(ostream &)> collect)
+{
+    lock_guard<mutex> lock(mutex_);
+    uint64_t id = next_collector_++;
+    collectors_[id] = move(collect);
+    return metrics_collector_t(*this, id);
+}
+
+void metrics_registry_t::remove_collector(uint64_t id)
+{
+    // render() holds the lock while collecting, so this waits for a running scrape
+    lock_guard<mutex> lock(mutex_);
+    collectors_.erase(id);
+}
+
+metrics_collector_t::~metrics_collector_t()
+{
+    release();
+}
+
+metrics_collector_t::metrics_collector_t(metrics_collector_t &&other) noexcept
+    : registry_(exchange(other.registry_, nullptr)), id_(other.id_)
+{
+}
+
+metrics_collector_t &metrics_collector_t::operator=(metrics_collector_t &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        registry_ = exchange(other.registry_, nullptr);
+        id_ = other.id_;
+    }
+    return *this;
+}
+
+void metrics_collector_t::release()
+{
+    if (registry_)
+    {
+        registry_->remove_collector(id_);
+        registry_ = nullptr;
+    }
+}
+
+string metrics_registry_t::render() const
+{
+    ostringstream out;
+    lock_guard<mutex> lock(mutex_);
+    for (const entry_t &entry : entries_)
+    {
+        out << "# HELP " << entry.name << ' ' << entry.help << '\n'
+            << "# TYPE " << entry.name << (entry.counter ? " counter\n" : " gauge\n") << entry.name << ' '
+            << (entry.counter ? to_string(entry.counter->value()) : to_string(entry.gauge->value())) << '\n';
+    }
+    for (const auto &[id, collect] : collectors_)
+    {
+        collect(out);
+    }
+    return out.str();
+}
+
+metrics_registry_t &metrics()
+{
+    static metrics_registry_t registry;
+    return registry;
+}
+
+metrics_server_t::metrics_server_t(const metrics_registry_t &registry, uint16_t port) : registry_(registry)
+{
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0)
+    {
+        throw runtime_error(string("Failed to create metrics socket: ") + strerror(errno));
+    }
+    int reuse = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+    // Localhost only, scrapes from elsewhere go through a local agent or proxy
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof address) != 0 || listen(listen_fd_, 16) != 0)
+    {
+        int error = errno;
+        close(listen_fd_);
+        throw runtime_error("Failed to listen on 127.0.0.1:" + to_string(port) + ": " + strerror(error));
+    }
+    thread_ = thread(&metrics_server_t::serve, this);
+}
+
+metrics_server_t::~metrics_server_t()
+{
+    stopping_ = true;
+    thread_.join();
+    close(listen_fd_);
+}
+
+void metrics_server_t::serve()
+{
+    while (!stopping_)
+    {
+        pollfd listening = {listen_fd_, POLLIN, 0};
+        if (poll(&listening, 1, ACCEPT_POLL_MS) <= 0)
+        {
+            continue;
+        }
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0)
+        {
+            answer(fd);
+            close(fd);
+        }
+    }
+}
+
+void metrics_server_t::answer(int fd)
+{
+    string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < 8192)
+    {
+        pollfd client = {fd, POLLIN, 0};
+        if (poll(&client, 1, REQUEST_TIMEOUT_MS) <= 0)
+        {
+            return;
+        }
+        ssize_t n = recv(fd, buffer, sizeof buffer, 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        request.append(buffer, n);
+    }
+
+    string status = "200 OK";
+    string body;
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0)
+    {
+        body = registry_.render();
+    }
+    else
+    {
+        status = "404 Not Found";
+        body = "Metrics are served at /metrics\n";
+    }
+    string response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) +
+                      "\r\nConnection: close\r\n\r\n" + body;
+    for (size_t sent = 0; sent < response.size();)
+    {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return;
+        }
+        sent += n;
+    }
+}
+
+void write_metrics_file(const metrics_registry_t &registry, const string &path)
+{
+    string temporary = path + ".tmp";
+    {
+        ofstream out(temporary);
+        out << registry.render();
+        if (!out.flush())
+        {
+            throw runtime_error("Failed to write " + temporary);
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        throw runtime_error("Failed to rename " + temporary + " to " + path + ": " + strerror(errno));
+    }
+}
+
+metrics_file_writer_t::metrics_file_writer_t(const metrics_registry_t &registry, const string &path, chrono::milliseconds interval)
+    : registry_(registry), path_(path)
+{
+    // The first write fails loudly, later ones only report and retry next interval
+    write_metrics_file(registry_, path_);
+    task_ = make_unique<periodic_task_t>(interval, [this]() { write(); });
+}
+
+metrics_file_writer_t::~metrics_file_writer_t()
+{
+    task_.reset();
+    write();
+}
+
+void metrics_file_writer_t::write() const
+{
+    try
+    {
+        write_metrics_file(registry_, path_);
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error, " + string(e.what()) + "\n";
+    }
+}
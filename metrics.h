@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "periodic_task.h"
+
+class metric_counter_t
+{
+public:
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+class metric_gauge_t
+{
+public:
+    void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    void set(int64_t n) { value_.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+class metrics_registry_t;
+
+// Keeps a collector registered until destroyed; once the destructor returns no
+// scrape is running it anymore, so it may refer to objects that die right after
+class metrics_collector_t
+{
+public:
+    metrics_collector_t() = default;
+    metrics_collector_t(metrics_registry_t &registry, uint64_t id) : registry_(&registry), id_(id) {}
+    ~metrics_collector_t();
+
+    metrics_collector_t(metrics_collector_t &&other) noexcept;
+    metrics_collector_t &operator=(metrics_collector_t &&other) noexcept;
+    metrics_collector_t(const metrics_collector_t &) = delete;
+    metrics_collector_t &operator=(const metrics_collector_t &) = delete;
+
+private:
+    void release();
+
+    metrics_registry_t *registry_ = nullptr;
+    uint64_t id_ = 0;
+};
+
+// Named counters and gauges plus collectors that render their own metrics at
+// scrape time, in the Prometheus text exposition format. Registering takes a
+// lock, updating a metric never does.
+class metrics_registry_t
+{
+public:
+    metric_counter_t &counter(const std::string &name, const std::string &help);
+    metric_gauge_t &gauge(const std::string &name, const std::string &help);
+    [[nodiscard]] metrics_collector_t collector(std::function<void(std::ostream &)> collect);
+
+    std::string render() const;
+
+private:
+    struct entry_t
+    {
+        std::string name;
+        std::string help;
+        std::unique_ptr<metric_counter_t> counter;
+        std::unique_ptr<metric_gauge_t> gauge;
+    };
+
+    friend class metrics_collector_t;
+    void remove_collector(uint64_t id);
+
+    mutable std::mutex mutex_;
+    std::vector<entry_t> entries_;
+    std::map<uint64_t, std::function<void(std::ostream &)>> collectors_;
+    uint64_t next_collector_ = 1;
+};
+
+// Metrics of this process
+metrics_registry_t &metrics();
+
+// Answers GET /metrics on 127.0.0.1:port until destroyed
+class metrics_server_t
+{
+public:
+    metrics_server_t(const metrics_registry_t &registry, uint16_t port);
+    ~metrics_server_t();
+
+    metrics_server_t(const metrics_server_t &) = delete;
+    metrics_server_t &operator=(const metrics_server_t &) = delete;
+
+private:
+    void serve();
+    void answer(int fd);
+
+    const metrics_registry_t &registry_;
+    int listen_fd_ = -1;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+// Replaces path with the current metrics in one rename, the way the node_exporter
+// textfile collector expects
+void write_metrics_file(const metrics_registry_t &registry, const std::string &path);
+
+// Rewrites path every interval and once more when destroyed
+class metrics_file_writer_t
+{
+public:
+    metrics_file_writer_t(const metrics_registry_t &registry, const std::string &path, std::chrono::milliseconds interval);
+    ~metrics_file_writer_t();
+
+private:
+    void write() const;
+
+    const metrics_registry_t &registry_;
+    std::string path_;
+    std::unique_ptr<periodic_task_t> task_;
+};
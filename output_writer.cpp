@@ -0,0 +1,300 @@
+#include "output_writer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "result_cache.h"
+#include "trace_recorder.h"
+
+using namespace std;
+
+string to_string(durability_t durability)
+{
+    switch (durability)
+    {
+    case durability_t::none:
+        return "none";
+    case durability_t::per_file:
+        return "file";
+    case durability_t::group:
+        return "group";
+    }
+    return "unknown";
+}
+
+durability_t parse_durability(const string &name)
+{
+    for (durability_t durability : {durability_t::none, durability_t::per_file, durability_t::group})
+    {
+        if (to_string(durability) == name)
+        {
+            return durability;
+        }
+    }
+    throw invalid_argument("Unknown durability " + name);
+}
+
+static void write_all(int fd, const void *data, size_t length, const string &filename)
+{
+    const char *p = static_cast<const char *>(data);
+    while (length > 0)
+    {
+        ssize_t n = ::write(fd, p, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            throw runtime_error("Failed to write " + filename + ": " + strerror(errno));
+        }
+        p += n;
+        length -= n;
+    }
+}
+
+static int open_directory(const filesystem::path &directory)
+{
+    int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw runtime_error("Failed to open directory " + directory.string() + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+output_writer_t::output_writer_t(durability_t durability, size_t group_files, chrono::milliseconds group_interval)
+    : durability_(durability), group_files_(group_files ? group_files : 1), group_interval_(group_interval)
+{
+    if (durability_ == durability_t::group)
+    {
+        // Catches groups that stop short of group_files
+        flusher_ = thread([this]()
+                          {
+                              trace_thread_name("group commit");
+                              unique_lock<mutex> lock(mutex_);
+                              while (!stopping_)
+                              {
+                                  wake_.wait_for(lock, group_interval_);
+                                  try
+                                  {
+                                      sync_locked(lock);
+                                  }
+                                  catch (const exception &e)
+                                  {
+                                      cerr << "Error, " << e.what() << endl;
+                                  }
+                              } });
+    }
+}
+
+output_writer_t::~output_writer_t()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (flusher_.joinable())
+    {
+        flusher_.join();
+    }
+    {
+        // Callbacks still pending belong to a run that did not finish, and what they
+        // refer to may be gone; without them the outputs are only redone next time
+        lock_guard<mutex> lock(mutex_);
+        committed_.clear();
+    }
+    try
+    {
+        sync();
+    }
+    catch (const exception &)
+    {
+    }
+    if (sync_fd_ >= 0)
+    {
+        close(sync_fd_);
+    }
+}
+
+void output_writer_t::write(const string &filename, const void *data, size_t length, committed_t committed)
+{
+    replace(filename, [&](const filesystem::path &temporary)
+            {
+                int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+                if (fd < 0)
+                {
+                    throw runtime_error("Failed to create " + temporary.string() + ": " + strerror(errno));
+                }
+                try
+                {
+                    write_all(fd, data, length, temporary.string());
+                    if (durability_ == durability_t::per_file && fsync(fd) != 0)
+                    {
+                        throw runtime_error("Failed to sync " + temporary.string() + ": " + strerror(errno));
+                    }
+                }
+                catch (...)
+                {
+                    close(fd);
+                    throw;
+                }
+                close(fd);
+            },
+            move(committed));
+}
+
+void output_writer_t::link(const string &from, const string &filename, committed_t committed)
+{
+    replace(filename, [&](const filesystem::path &temporary)
+            {
+                link_or_copy(from, temporary);
+                if (durability_ == durability_t::per_file)
+                {
+                    // Linked data is only as durable as whoever wrote it made it
+                    int fd = open(temporary.c_str(), O_RDONLY | O_CLOEXEC);
+                    int result = fd < 0 ? -1 : fsync(fd);
+                    int error = errno;
+                    if (fd >= 0)
+                    {
+                        close(fd);
+                    }
+                    if (result != 0)
+                    {
+                        throw runtime_error("Failed to sync " + temporary.string() + ": " + strerror(error));
+                    }
+                }
+            },
+            move(committed));
+}
+
+template <typename produce_t>
+void output_writer_t::replace(const string &filename, produce_t produce, committed_t committed)
+{
+    filesystem::path path(filename);
+    // Hidden and unique per write, so concurrent writers of one name cannot collide
+    filesystem::path temporary = path.parent_path() / ("." + path.filename().string() + ".tmp-" + to_string(getpid()) + "-" + to_string(sequence_++));
+
+    try
+    {
+        produce(temporary);
+    }
+    catch (...)
+    {
+        unlink(temporary.c_str());
+        throw;
+    }
+
+    // rename() replaces the name, never the inode, so a hardlinked old output is left alone
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        int error = errno;
+        unlink(temporary.c_str());
+        throw runtime_error("Failed to rename " + temporary.string() + " to " + filename + ": " + strerror(error));
+    }
+
+    if (durability_ == durability_t::per_file)
+    {
+        // The rename itself is only durable once the directory is synced
+        int directory = open_directory(path.parent_path());
+        int result = fsync(directory);
+        close(directory);
+        if (result != 0)
+        {
+            throw runtime_error("Failed to sync directory of " + filename + ": " + strerror(errno));
+        }
+        syncs_++;
+        if (committed)
+        {
+            committed();
+        }
+    }
+    else if (durability_ == durability_t::none)
+    {
+        // Nothing is waited for, so the output counts as done once it has its name; a
+        // crash-resumed run and the cache see it right away
+        if (committed)
+        {
+            committed();
+        }
+    }
+    else
+    {
+        unique_lock<mutex> lock(mutex_);
+        if (sync_fd_ < 0)
+        {
+            sync_fd_ = open_directory(path.parent_path());
+        }
+        if (committed)
+        {
+            committed_.push_back(move(committed));
+        }
+        pending_++;
+        if (pending_ >= group_files_)
+        {
+            sync_locked(lock);
+        }
+    }
+}
+
+void output_writer_t::sync()
+{
+    unique_lock<mutex> lock(mutex_);
+    sync_locked(lock);
+}
+
+void output_writer_t::sync_locked(unique_lock<mutex> &lock)
+{
+    if (pending_ == 0 || sync_fd_ < 0)
+    {
+        return;
+    }
+    pending_ = 0;
+    // Only what was written before the syncfs started is covered by it
+    vector<committed_t> committed;
+    committed.swap(committed_);
+    // One syncfs covers the data and the renames of the whole group; other
+    // writers keep going while it runs and land in the next group
+    int fd = sync_fd_;
+    lock.unlock();
+    int result;
+    {
+        trace_scope_t span("syncfs");
+        result = syncfs(fd);
+    }
+    int error = errno;
+    exception_ptr failure;
+    if (result == 0)
+    {
+        for (committed_t &callback : committed)
+        {
+            try
+            {
+                callback();
+            }
+            catch (...)
+            {
+                failure = failure ? failure : current_exception();
+            }
+        }
+    }
+    lock.lock();
+    syncs_++;
+    if (result != 0)
+    {
+        // The callbacks are dropped, their outputs are redone on the next run
+        throw runtime_error(string("syncfs failed: ") + strerror(error));
+    }
+    if (failure)
+    {
+        rethrow_exception(failure);
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How hard write() works to make outputs survive a crash
+enum class durability_t
+{
+    none,     // atomic replace only, the kernel writes back whenever it likes
+    per_file, // fsync of every file and of its directory before write() returns
+    group     // one syncfs per group_files outputs or group_interval, whichever comes first
+};
+
+std::string to_string(durability_t durability);
+durability_t parse_durability(const std::string &name);
+
+// Writes outputs through a temporary file in the same directory that is renamed
+// over the final name once complete, so readers and crashes never see a partially
+// written image under the final name. Safe to use from several threads.
+class output_writer_t
+{
+public:
+    output_writer_t(durability_t durability, size_t group_files, std::chrono::milliseconds group_interval);
+    ~output_writer_t();
+
+    output_writer_t(const output_writer_t &) = delete;
+    output_writer_t &operator=(const output_writer_t &) = delete;
+
+    // Runs once the output is durable, to record it only then: before write() or link()
+    // returns with per_file and none (which promises no more than the rename), after the
+    // syncfs that covers it with group
+    using committed_t = std::function<void()>;
+
+    void write(const std::string &filename, const void *data, size_t length, committed_t committed = {});
+
+    // Gives the contents of from the name filename the way write() does, hardlinked,
+    // reflinked or copied to the temporary name. from must not change afterwards.
+    void link(const std::string &from, const std::string &filename, committed_t committed = {});
+
+    // Makes everything written so far durable and runs the pending committed callbacks
+    // (a no-op for per_file)
+    void sync();
+
+    size_t syncs() const { return syncs_; }
+
+private:
+    template <typename produce_t>
+    void replace(const std::string &filename, produce_t produce, committed_t committed);
+    void sync_locked(std::unique_lock<std::mutex> &lock);
+
+    durability_t durability_;
+    size_t group_files_;
+    std::chrono::milliseconds group_interval_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    // A directory on the output filesystem, syncfs() needs a descriptor of it
+    int sync_fd_ = -1;
+    size_t pending_ = 0;
+    std::vector<committed_t> committed_;
+    bool stopping_ = false;
+    std::atomic<size_t> syncs_{0};
+    std::atomic<uint64_t> sequence_{0};
+    std::thread flusher_;
+};
@@ -0,0 +1,102 @@
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "packed_store.h"
+
+using namespace std;
+
+// Stored names end up below the extract directory, never outside it
+static bool safe_name(const string &name)
+{
+    filesystem::path path(name);
+    if (name.empty() || path.is_absolute())
+    {
+        return false;
+    }
+    for (const filesystem::path &part : path)
+    {
+        if (part == "..")
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void print_usage(const char *program)
+{
+    cerr << "Usage: " << program << " list STORE\n"
+         << "       " << program << " get STORE NAME        write NAME to stdout\n"
+         << "       " << program << " extract STORE DIR     write every stored image below DIR\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    string command = argv[1];
+
+    try
+    {
+        packed_store_reader_t store(argv[2]);
+        if (command == "list" && argc == 3)
+        {
+            for (const string &name : store.names())
+            {
+                const packed_location_t &location = store.location(name);
+                cout << name << '\t' << location.length << '\t' << location.segment << '\t' << location.offset << '\n';
+            }
+        }
+        else if (command == "get" && argc == 4)
+        {
+            vector<unsigned char> data;
+            if (!store.fetch(argv[3], data))
+            {
+                cerr << "Error, " << argv[3] << " is not in " << argv[2] << endl;
+                return 1;
+            }
+            cout.write(reinterpret_cast<const char *>(data.data()), data.size());
+        }
+        else if (command == "extract" && argc == 4)
+        {
+            vector<unsigned char> data;
+            for (const string &name : store.names())
+            {
+                if (!safe_name(name))
+                {
+                    cerr << "Error, refusing to extract " << name << ", it would land outside " << argv[3] << endl;
+                    return 1;
+                }
+            }
+            for (const string &name : store.names())
+            {
+                filesystem::path path = filesystem::path(argv[3]) / name;
+                filesystem::create_directories(path.parent_path());
+                store.fetch(name, data);
+                ofstream out(path, ios::binary);
+                if (!out.write(reinterpret_cast<const char *>(data.data()), data.size()))
+                {
+                    cerr << "Error writing " << path << endl;
+                    return 1;
+                }
+            }
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "Error, " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,383 @@
+#include "packed_store.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+const char *const PACKED_STORE_INDEX = "index";
+
+// Record header: magic, name length (u32), data length (u64), all little-endian, then name and data
+static const char RECORD_MAGIC[4] = {'B', 'B', 'P', 'K'};
+static const size_t RECORD_HEADER_SIZE = 16;
+static const char *const SEGMENT_EXTENSION = ".pack";
+
+static void put_le(unsigned char *out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+    {
+        out[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t get_le(const unsigned char *in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i)
+    {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+static void write_all(int fd, const void *data, size_t length, const string &segment)
+{
+    const char *p = static_cast<const char *>(data);
+    while (length > 0)
+    {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            throw runtime_error("Failed to append to " + segment + ": " + strerror(errno));
+        }
+        p += n;
+        length -= n;
+    }
+}
+
+// Index lines: name, segment, offset, length separated by tabs
+static map<string, packed_location_t> load_index(const string &path)
+{
+    map<string, packed_location_t> index;
+    ifstream in(path);
+    string line;
+    while (getline(in, line))
+    {
+        size_t a = line.find('\t');
+        size_t b = line.find('\t', a + 1);
+        size_t c = line.find('\t', b + 1);
+        if (c == string::npos)
+        {
+            throw runtime_error("Corrupt packed store index " + path);
+        }
+        packed_location_t location{line.substr(a + 1, b - a - 1), stoull(line.substr(b + 1, c - b - 1)), stoull(line.substr(c + 1))};
+        index[line.substr(0, a)] = location;
+    }
+    return index;
+}
+
+// Flushes a finished file before closing it; the index must never point at data that
+// is not durable yet
+static void sync_and_close(int fd, const string &path)
+{
+    bool synced = fdatasync(fd) == 0;
+    int error = errno;
+    ::close(fd);
+    if (!synced)
+    {
+        throw runtime_error("Failed to sync " + path + ": " + strerror(error));
+    }
+}
+
+static void sync_directory(const string &directory)
+{
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0)
+    {
+        int error = errno;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        throw runtime_error("Failed to sync " + directory + ": " + strerror(error));
+    }
+    ::close(fd);
+}
+
+// Written to a temporary, synced and renamed over the old index, then the directory is
+// synced so the rename and the new segments' names survive a crash too
+static void save_index(const string &directory, const map<string, packed_location_t> &index)
+{
+    filesystem::path path = filesystem::path(directory) / PACKED_STORE_INDEX;
+    string temporary = path.string() + ".tmp";
+    string lines;
+    for (const auto &[name, location] : index)
+    {
+        lines += name + '\t' + location.segment + '\t' + to_string(location.offset) + '\t' + to_string(location.length) + '\n';
+    }
+
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw runtime_error("Failed to create " + temporary + ": " + strerror(errno));
+    }
+    try
+    {
+        write_all(fd, lines.data(), lines.size(), temporary);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+    sync_and_close(fd, temporary);
+    filesystem::rename(temporary, path);
+    sync_directory(directory);
+}
+
+packed_store_writer_t::packed_store_writer_t(const string &directory, uint64_t segment_size, unsigned lanes)
+    : directory_(directory), segment_size_(segment_size)
+{
+    filesystem::create_directories(directory_);
+    // Segments of every run get their own names, so reopening never touches old data
+    run_id_ = to_string(chrono::system_clock::now().time_since_epoch().count()) + "-" + to_string(getpid());
+    for (unsigned i = 0; i < max(1u, lanes); ++i)
+    {
+        lanes_.push_back(make_unique<lane_t>());
+    }
+}
+
+packed_store_writer_t::~packed_store_writer_t()
+{
+    try
+    {
+        close();
+    }
+    catch (const exception &)
+    {
+        // The segments are self-describing, a reader rebuilds the index
+    }
+}
+
+void packed_store_writer_t::open_segment(lane_t &lane, unsigned lane_index)
+{
+    if (lane.fd >= 0)
+    {
+        int fd = lane.fd;
+        lane.fd = -1;
+        sync_and_close(fd, lane.segment);
+    }
+    lane.segment = run_id_ + "-" + to_string(lane_index) + "-" + to_string(lane.sequence++) + SEGMENT_EXTENSION;
+    string path = (filesystem::path(directory_) / lane.segment).string();
+    lane.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (lane.fd < 0)
+    {
+        throw runtime_error("Failed to create " + path + ": " + strerror(errno));
+    }
+    lane.size = 0;
+}
+
+void packed_store_writer_t::append(const string &name, const unsigned char *data, size_t length)
+{
+    if (name.find_first_of("\t\n") != string::npos)
+    {
+        throw invalid_argument("Packed store names cannot contain tabs or newlines: " + name);
+    }
+
+    // Threads keep to one lane, so appends from different workers rarely share a lock
+    unsigned lane_index = hash<thread::id>()(this_thread::get_id()) % lanes_.size();
+    lane_t &lane = *lanes_[lane_index];
+    lock_guard<mutex> lock(lane.mutex);
+    if (closed_)
+    {
+        throw runtime_error("Packed store is closed");
+    }
+    if (lane.fd < 0 || (lane.size > 0 && lane.size + RECORD_HEADER_SIZE + name.size() + length > segment_size_))
+    {
+        open_segment(lane, lane_index);
+    }
+
+    unsigned char header[RECORD_HEADER_SIZE];
+    memcpy(header, RECORD_MAGIC, sizeof RECORD_MAGIC);
+    put_le(header + 4, name.size(), 4);
+    put_le(header + 8, length, 8);
+    write_all(lane.fd, header, sizeof header, lane.segment);
+    write_all(lane.fd, name.data(), name.size(), lane.segment);
+    write_all(lane.fd, data, length, lane.segment);
+
+    lane.entries.push_back({name, {lane.segment, lane.size + RECORD_HEADER_SIZE + name.size(), length}});
+    lane.size += RECORD_HEADER_SIZE + name.size() + length;
+}
+
+// Adds the records of the segments index does not reference, left by writers that died
+// before close(). Segment names start with the time of their run, so where two records
+// share a name the one from the later segment wins.
+static void recover_segments(const string &directory, map<string, packed_location_t> &index, const set<string> &skip,
+                             const function<const mapped_file_t &(const string &)> &map_segment)
+{
+    set<string> referenced = skip;
+    for (const auto &entry : index)
+    {
+        referenced.insert(entry.second.segment);
+    }
+    vector<string> unreferenced;
+    for (auto &file : filesystem::directory_iterator{directory})
+    {
+        string segment = file.path().filename().string();
+        if (file.path().extension() == SEGMENT_EXTENSION && !referenced.count(segment))
+        {
+            unreferenced.push_back(segment);
+        }
+    }
+    sort(unreferenced.begin(), unreferenced.end());
+    for (const string &segment : unreferenced)
+    {
+        const mapped_file_t &file = map_segment(segment);
+        for (uint64_t offset = 0; offset + RECORD_HEADER_SIZE <= file.size();)
+        {
+            const unsigned char *header = file.data() + offset;
+            uint64_t name_length = get_le(header + 4, 4);
+            uint64_t length = get_le(header + 8, 8);
+            if (memcmp(header, RECORD_MAGIC, sizeof RECORD_MAGIC) != 0 ||
+                file.size() - offset - RECORD_HEADER_SIZE < name_length ||
+                file.size() - offset - RECORD_HEADER_SIZE - name_length < length)
+            {
+                // Torn tail of a crashed append
+                break;
+            }
+            string name(reinterpret_cast<const char *>(header + RECORD_HEADER_SIZE), name_length);
+            auto it = index.find(name);
+            if (it == index.end() || it->second.segment <= segment)
+            {
+                index[name] = {segment, offset + RECORD_HEADER_SIZE + name_length, length};
+            }
+            offset += RECORD_HEADER_SIZE + name_length + length;
+        }
+    }
+}
+
+void packed_store_writer_t::close()
+{
+    // Every lane stays locked until closed_ is set, so no append lands after its lane was synced
+    vector<unique_lock<mutex>> locks;
+    for (auto &lane : lanes_)
+    {
+        locks.emplace_back(lane->mutex);
+    }
+    if (closed_)
+    {
+        return;
+    }
+
+    set<string> own_segments;
+    exception_ptr sync_error;
+    for (auto &lane : lanes_)
+    {
+        if (lane->fd >= 0)
+        {
+            int fd = lane->fd;
+            lane->fd = -1;
+            try
+            {
+                sync_and_close(fd, lane->segment);
+            }
+            catch (...)
+            {
+                sync_error = current_exception();
+            }
+        }
+        for (auto &entry : lane->entries)
+        {
+            own_segments.insert(entry.second.segment);
+        }
+    }
+    closed_ = true;
+    // Without an index entry a segment is still found by recovery, once it can be read back
+    if (sync_error)
+    {
+        rethrow_exception(sync_error);
+    }
+
+    filesystem::path index_path = filesystem::path(directory_) / PACKED_STORE_INDEX;
+    map<string, packed_location_t> index = filesystem::exists(index_path) ? load_index(index_path.string()) : map<string, packed_location_t>{};
+    // Runs that died since the index was written are older than this one
+    map<string, mapped_file_t> recovered;
+    recover_segments(directory_, index, own_segments, [&](const string &segment) -> const mapped_file_t &
+                     { return recovered.emplace(segment, mapped_file_t((filesystem::path(directory_) / segment).string())).first->second; });
+    for (auto &lane : lanes_)
+    {
+        for (auto &[name, location] : lane->entries)
+        {
+            index[name] = location;
+        }
+    }
+    save_index(directory_, index);
+}
+
+packed_store_reader_t::packed_store_reader_t(const string &directory) : directory_(directory)
+{
+    filesystem::path index_path = filesystem::path(directory_) / PACKED_STORE_INDEX;
+    if (filesystem::exists(index_path))
+    {
+        index_ = load_index(index_path.string());
+    }
+    // Also whatever writers appended without reaching close(), or everything without an index
+    recover_segments(directory_, index_, {}, [this](const string &name) -> const mapped_file_t & { return segment(name); });
+}
+
+const mapped_file_t &packed_store_reader_t::segment(const string &name)
+{
+    auto it = segments_.find(name);
+    if (it == segments_.end())
+    {
+        it = segments_.emplace(name, mapped_file_t((filesystem::path(directory_) / name).string())).first;
+    }
+    return it->second;
+}
+
+bool packed_store_reader_t::contains(const string &name) const
+{
+    return index_.count(name) > 0;
+}
+
+const packed_location_t &packed_store_reader_t::location(const string &name) const
+{
+    auto it = index_.find(name);
+    if (it == index_.end())
+    {
+        throw out_of_range("Not in packed store: " + name);
+    }
+    return it->second;
+}
+
+bool packed_store_reader_t::fetch(const string &name, vector<unsigned char> &data)
+{
+    auto it = index_.find(name);
+    if (it == index_.end())
+    {
+        return false;
+    }
+    const mapped_file_t &file = segment(it->second.segment);
+    if (it->second.offset + it->second.length > file.size())
+    {
+        throw runtime_error("Packed store entry " + name + " points past the end of " + it->second.segment);
+    }
+    data.assign(file.data() + it->second.offset, file.data() + it->second.offset + it->second.length);
+    return true;
+}
+
+vector<string> packed_store_reader_t::names() const
+{
+    vector<string> names;
+    names.reserve(index_.size());
+    for (const auto &entry : index_)
+    {
+        names.push_back(entry.first);
+    }
+    return names;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Location of one stored object
+struct packed_location_t
+{
+    std::string segment;
+    uint64_t offset = 0; // of the data, past the record header
+    uint64_t length = 0;
+};
+
+// Output backend that appends encoded images to large segment files instead of
+// creating one file per image. Every record carries a small header with its name,
+// so the offset/length index written by close() can be rebuilt from the segments
+// if the process dies before. Appends are spread over independent lanes, each
+// with its own segment and lock, so concurrent workers do not serialize on one
+// file. Reopening a store appends new segments and keeps the existing index;
+// readers and the next close() pick up the segments it does not reference.
+class packed_store_writer_t
+{
+public:
+    packed_store_writer_t(const std::string &directory, uint64_t segment_size, unsigned lanes);
+    ~packed_store_writer_t();
+
+    void append(const std::string &name, const unsigned char *data, size_t length);
+
+    // Syncs the segments and writes the merged index
+    void close();
+
+private:
+    struct lane_t
+    {
+        std::mutex mutex;
+        int fd = -1;
+        std::string segment;
+        uint64_t size = 0;
+        unsigned sequence = 0;
+        std::vector<std::pair<std::string, packed_location_t>> entries;
+    };
+
+    void open_segment(lane_t &lane, unsigned lane_index);
+
+    std::string directory_;
+    uint64_t segment_size_;
+    std::string run_id_;
+    std::vector<std::unique_ptr<lane_t>> lanes_;
+    bool closed_ = false;
+};
+
+class packed_store_reader_t
+{
+public:
+    // Loads the index and adds the records of the segments it does not reference
+    explicit packed_store_reader_t(const std::string &directory);
+
+    bool contains(const std::string &name) const;
+
+    // Copies the object out, returns false if name is not stored
+    bool fetch(const std::string &name, std::vector<unsigned char> &data);
+
+    // Stored names, sorted
+    std::vector<std::string> names() const;
+
+    const packed_location_t &location(const std::string &name) const;
+
+private:
+    const mapped_file_t &segment(const std::string &name);
+
+    std::string directory_;
+    std::map<std::string, packed_location_t> index_;
+    std::unordered_map<std::string, mapped_file_t> segments_;
+};
+
+// Name of the index file inside a store directory
+extern const char *const PACKED_STORE_INDEX;
@@ -0,0 +1,208 @@
+#include "parallel_deflate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <zlib.h>
+
+using namespace std;
+
+// deflate's maximum back-reference distance
+static const size_t DICTIONARY_SIZE = 32 * 1024;
+
+struct deflate_chunk_t
+{
+    vector<unsigned char> compressed;
+    uLong adler = 0;
+    size_t length = 0;
+    bool ok = false;
+};
+
+// Helper threads shared by every parallel_deflate call. They are started on first
+// use, up to the most any call asked for, and live as long as the process.
+class deflate_pool_t
+{
+public:
+    ~deflate_pool_t()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        available_.notify_all();
+        for (thread &t : threads_)
+        {
+            t.join();
+        }
+    }
+
+    // Queues task once for each of helpers threads
+    void run(const function<void()> &task, unsigned helpers)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            while (threads_.size() < helpers)
+            {
+                threads_.emplace_back([this]() { work(); });
+            }
+            tasks_.insert(tasks_.end(), helpers, task);
+        }
+        available_.notify_all();
+    }
+
+private:
+    void work()
+    {
+        unique_lock<mutex> lock(mutex_);
+        while (true)
+        {
+            available_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty())
+            {
+                return;
+            }
+            function<void()> task = move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    mutex mutex_;
+    condition_variable available_;
+    deque<function<void()>> tasks_;
+    vector<thread> threads_;
+    bool stopping_ = false;
+};
+
+static deflate_pool_t &deflate_pool()
+{
+    static deflate_pool_t pool;
+    return pool;
+}
+
+static void deflate_chunk(const unsigned char *data, size_t length, size_t offset, size_t size, int level, deflate_chunk_t &chunk)
+{
+    z_stream stream{};
+    // Negative window bits produce raw deflate, the header and trailer are written once for the whole stream
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return;
+    }
+
+    if (offset > 0)
+    {
+        size_t dictionary = min(offset, DICTIONARY_SIZE);
+        deflateSetDictionary(&stream, data + offset - dictionary, dictionary);
+    }
+
+    bool last = offset + size == length;
+    // Room for the sync flush marker and the final block on top of deflateBound
+    chunk.compressed.resize(deflateBound(&stream, size) + 16);
+    stream.next_in = const_cast<unsigned char *>(data + offset);
+    stream.avail_in = size;
+    stream.next_out = chunk.compressed.data();
+    stream.avail_out = chunk.compressed.size();
+
+    // A sync flush ends the chunk on a byte boundary without setting BFINAL
+    int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    chunk.ok = last ? result == Z_STREAM_END : (result == Z_OK && stream.avail_in == 0);
+    chunk.compressed.resize(stream.total_out);
+    chunk.adler = adler32(1, data + offset, size);
+    chunk.length = size;
+    deflateEnd(&stream);
+}
+
+vector<unsigned char> parallel_deflate(const unsigned char *data, size_t length, int level, unsigned num_threads, size_t chunk_size)
+{
+    if (chunk_size == 0)
+    {
+        throw invalid_argument("Deflate chunk size must be positive");
+    }
+
+    // Shared with the pool tasks, which may only get to run after this call returned
+    struct job_t
+    {
+        vector<deflate_chunk_t> chunks;
+        atomic<size_t> next_chunk{0};
+        size_t done = 0;
+        mutex done_mutex;
+        condition_variable finished;
+    };
+    auto job = make_shared<job_t>();
+    size_t num_chunks = max<size_t>(1, (length + chunk_size - 1) / chunk_size);
+    job->chunks.resize(num_chunks);
+
+    auto worker = [job, data, length, chunk_size, level, num_chunks]()
+    {
+        size_t deflated = 0;
+        for (size_t i = job->next_chunk++; i < num_chunks; i = job->next_chunk++)
+        {
+            size_t offset = i * chunk_size;
+            deflate_chunk(data, length, offset, min(chunk_size, length - offset), level, job->chunks[i]);
+            deflated++;
+        }
+        if (deflated)
+        {
+            lock_guard<mutex> lock(job->done_mutex);
+            job->done += deflated;
+            if (job->done == num_chunks)
+            {
+                job->finished.notify_all();
+            }
+        }
+    };
+
+    num_threads = max(1u, min<unsigned>(num_threads, num_chunks));
+    if (num_threads > 1)
+    {
+        deflate_pool().run(worker, num_threads - 1);
+    }
+    worker();
+    {
+        unique_lock<mutex> lock(job->done_mutex);
+        job->finished.wait(lock, [&]() { return job->done == num_chunks; });
+    }
+    const vector<deflate_chunk_t> &chunks = job->chunks;
+
+    // zlib header: deflate with a 32 KiB window, FLEVEL hint and the FCHECK bits
+    int flevel = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned header = 0x7800 | (flevel << 6);
+    header += (31 - header % 31) % 31;
+
+    size_t total = 6;
+    for (const deflate_chunk_t &chunk : chunks)
+    {
+        total += chunk.compressed.size();
+    }
+
+    vector<unsigned char> out;
+    out.reserve(total);
+    out.push_back(header >> 8);
+    out.push_back(header & 0xff);
+
+    uLong adler = adler32(0, nullptr, 0);
+    for (const deflate_chunk_t &chunk : chunks)
+    {
+        if (!chunk.ok)
+        {
+            throw runtime_error("Failed to deflate chunk");
+        }
+        out.insert(out.end(), chunk.compressed.begin(), chunk.compressed.end());
+        adler = adler32_combine(adler, chunk.adler, chunk.length);
+    }
+
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        out.push_back((adler >> shift) & 0xff);
+    }
+    return out;
+}
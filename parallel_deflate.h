@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Default amount of input deflated by each worker, same as pigz
+static const size_t PARALLEL_DEFLATE_CHUNK_SIZE = 128 * 1024;
+
+// Compresses data into a single zlib stream, deflating chunk_size pieces on
+// up to num_threads threads. Each chunk is primed with the last 32 KiB of the
+// previous chunk as dictionary and ends with a sync flush, so the pieces can
+// be concatenated behind one zlib header and a combined Adler-32.
+std::vector<unsigned char> parallel_deflate(const unsigned char *data, size_t length, int level,
+                                            unsigned num_threads, size_t chunk_size = PARALLEL_DEFLATE_CHUNK_SIZE);
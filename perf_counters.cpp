@@ -0,0 +1,164 @@
+#include "perf_counters.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+const char *to_string(perf_event_t event)
+{
+    switch (event)
+    {
+    case perf_event_t::cycles:
+        return "cycles";
+    case perf_event_t::instructions:
+        return "instructions";
+    case perf_event_t::l1d_misses:
+        return "L1D misses";
+    case perf_event_t::llc_misses:
+        return "LLC misses";
+    case perf_event_t::branch_misses:
+        return "branch misses";
+    case perf_event_t::count:
+        break;
+    }
+    return "unknown";
+}
+
+static perf_event_attr event_attr(perf_event_t event)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (event)
+    {
+    case perf_event_t::cycles:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case perf_event_t::instructions:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case perf_event_t::l1d_misses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case perf_event_t::llc_misses:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case perf_event_t::branch_misses:
+    case perf_event_t::count:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return attr;
+}
+
+static int open_event(perf_event_t event, int group_fd)
+{
+    perf_event_attr attr = event_attr(event);
+    // The leader starts disabled and enables the whole group at once
+    attr.disabled = group_fd < 0;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+perf_group_t::perf_group_t()
+{
+    fds_.fill(-1);
+    slots_.fill(-1);
+    leader_ = open_event(perf_event_t::cycles, -1);
+    if (leader_ < 0)
+    {
+        return;
+    }
+    fds_[0] = leader_;
+    slots_[0] = opened_++;
+    for (size_t e = 1; e < PERF_EVENT_COUNT; ++e)
+    {
+        fds_[e] = open_event(static_cast<perf_event_t>(e), leader_);
+        if (fds_[e] >= 0)
+        {
+            slots_[e] = opened_++;
+        }
+    }
+    ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+perf_group_t::~perf_group_t()
+{
+    for (int fd : fds_)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+perf_sample_t perf_group_t::read() const
+{
+    perf_sample_t sample{};
+    if (!valid())
+    {
+        return sample;
+    }
+    // nr, time_enabled, time_running, then one value per opened event
+    uint64_t data[3 + PERF_EVENT_COUNT];
+    ssize_t length = ::read(leader_, data, sizeof data);
+    if (length < ssize_t(3 * sizeof(uint64_t)) || data[0] != uint64_t(opened_))
+    {
+        return sample;
+    }
+    sample.time_enabled = data[1];
+    sample.time_running = data[2];
+    for (size_t e = 0; e < PERF_EVENT_COUNT; ++e)
+    {
+        if (slots_[e] >= 0)
+        {
+            sample.values[e] = data[3 + slots_[e]];
+        }
+    }
+    return sample;
+}
+
+bool perf_delta(const perf_sample_t &from, const perf_sample_t &to, perf_counts_t &counts)
+{
+    uint64_t enabled = to.time_enabled - from.time_enabled;
+    uint64_t running = to.time_running - from.time_running;
+    if (!running)
+    {
+        return false;
+    }
+    // Scaling the totals instead would make their difference wrap whenever the ratio moved
+    double scale = running < enabled ? double(enabled) / running : 1;
+    for (size_t e = 0; e < PERF_EVENT_COUNT; ++e)
+    {
+        counts[e] = (to.values[e] - from.values[e]) * scale;
+    }
+    return true;
+}
+
+const perf_group_t &thread_perf_group()
+{
+    thread_local perf_group_t group;
+    return group;
+}
+
+string perf_counters_unavailable()
+{
+    int fd = open_event(perf_event_t::cycles, -1);
+    if (fd < 0)
+    {
+        return strerror(errno);
+    }
+    close(fd);
+    return "";
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Hardware events counted per thread with --perf-counters
+enum class perf_event_t
+{
+    cycles,
+    instructions,
+    l1d_misses, // L1 data cache read misses
+    llc_misses, // last level cache misses
+    branch_misses,
+    count
+};
+
+static const size_t PERF_EVENT_COUNT = static_cast<size_t>(perf_event_t::count);
+
+// Events counted over some stretch of time, indexed by perf_event_t
+typedef std::array<uint64_t, PERF_EVENT_COUNT> perf_counts_t;
+
+// One read of a group: raw running totals, and how long the group was enabled and
+// how long it was actually on the PMU
+struct perf_sample_t
+{
+    perf_counts_t values{};
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+};
+
+// Events between two reads of a group, scaled up by the share of that stretch the
+// kernel had the counters multiplexed out. Returns false if they never ran in
+// between, the events are then unknown rather than zero.
+bool perf_delta(const perf_sample_t &from, const perf_sample_t &to, perf_counts_t &counts);
+
+const char *to_string(perf_event_t event);
+
+// One perf_event_open group counting the calling thread in user space. Events
+// the host does not support stay at zero; without a PMU or without permission
+// (perf_event_paranoid) the whole group is invalid and read() returns zeros.
+class perf_group_t
+{
+public:
+    perf_group_t();
+    ~perf_group_t();
+
+    perf_group_t(const perf_group_t &) = delete;
+    perf_group_t &operator=(const perf_group_t &) = delete;
+
+    bool valid() const { return leader_ >= 0; }
+
+    // Running totals since the group was opened, unscaled; see perf_delta
+    perf_sample_t read() const;
+
+private:
+    int leader_ = -1;
+    std::array<int, PERF_EVENT_COUNT> fds_;
+    // Position of every event in the group read, events that failed to open have none
+    std::array<int, PERF_EVENT_COUNT> slots_;
+    int opened_ = 0;
+};
+
+// The group of the calling thread, opened on first use
+const perf_group_t &thread_perf_group();
+
+// Why counters cannot be used on this host, empty if they can
+std::string perf_counters_unavailable();
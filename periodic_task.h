@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Runs task every interval on its own thread until destroyed. Destruction stops
+// the thread without a final run, callers report the end state themselves.
+class periodic_task_t
+{
+public:
+    periodic_task_t(std::chrono::milliseconds interval, std::function<void()> task)
+        : thread_([this, interval, task = std::move(task)]()
+                  {
+                      std::unique_lock<std::mutex> lock(mutex_);
+                      while (!wake_.wait_for(lock, interval, [&] { return stopping_; }))
+                      {
+                          lock.unlock();
+                          task();
+                          lock.lock();
+                      }
+                  })
+    {
+    }
+
+    ~periodic_task_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    periodic_task_t(const periodic_task_t &) = delete;
+    periodic_task_t &operator=(const periodic_task_t &) = delete;
+
+private:
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
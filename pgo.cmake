@@ -0,0 +1,52 @@
+# Profile-guided build in one go, run from the source directory:
+#
+#   cmake -P pgo.cmake                      # builds in _pgo/
+#   cmake -DBINARY_DIR=/tmp/pgo -DLTO=ON -P pgo.cmake
+#   cmake "-DCMAKE_ARGS=-DCMAKE_CXX_COMPILER=clang++" -P pgo.cmake
+#
+# Builds a plain Release tree, an instrumented tree that is trained with pgo_train,
+# and the optimized tree using its profile, then benchmarks the kernels of the
+# optimized tree against the plain one. The tools to install are in _pgo/use.
+
+if(NOT SOURCE_DIR)
+    set(SOURCE_DIR ${CMAKE_CURRENT_LIST_DIR})
+endif()
+if(NOT BINARY_DIR)
+    set(BINARY_DIR ${SOURCE_DIR}/_pgo)
+endif()
+if(NOT LTO)
+    set(LTO OFF)
+endif()
+if(NOT BENCH_ARGS)
+    set(BENCH_ARGS --sizes=1,4 --channels=3 --filters=5,9 --reps=7)
+endif()
+set(PROFILE_DIR ${BINARY_DIR}/profile)
+
+function(run)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+    if(result)
+        string(REPLACE ";" " " command "${ARGN}")
+        message(FATAL_ERROR "Failed (${result}): ${command}")
+    endif()
+endfunction()
+
+function(build_tree name)
+    message(STATUS "Building ${BINARY_DIR}/${name}")
+    run(${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${BINARY_DIR}/${name} -DCMAKE_BUILD_TYPE=Release -DBOX_BLUR_LTO=${LTO}
+        -DBOX_BLUR_PGO_DIR=${PROFILE_DIR} ${CMAKE_ARGS} ${ARGN})
+    run(${CMAKE_COMMAND} --build ${BINARY_DIR}/${name} --target box_blur box_blur_bench)
+endfunction()
+
+# Stale counters from an earlier training would be added to the new ones
+file(REMOVE_RECURSE ${PROFILE_DIR})
+
+build_tree(plain -DBOX_BLUR_PGO=OFF)
+build_tree(generate -DBOX_BLUR_PGO=GENERATE)
+message(STATUS "Training")
+run(${CMAKE_COMMAND} --build ${BINARY_DIR}/generate --target pgo_train)
+build_tree(use -DBOX_BLUR_PGO=USE)
+
+message(STATUS "Benchmarking the profile-guided build against the plain one")
+run(${BINARY_DIR}/plain/box_blur_bench ${BENCH_ARGS} --json=${BINARY_DIR}/plain.json)
+# A cell only counts as slower with significance, faster cells show as negative changes
+execute_process(COMMAND ${BINARY_DIR}/use/box_blur_bench ${BENCH_ARGS} --baseline=${BINARY_DIR}/plain.json)
@@ -0,0 +1,382 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const string SIDECAR_SUFFIX = ".json";
+// Uses of entries as "<bytes> <name>" and removals as "- <name>", one per line, oldest first
+static const string ACCESS_LOG = "access.log";
+static const string REMOVED = "-";
+// In the names of files that are still being linked into the cache
+static const string TEMPORARY_INFIX = ".tmp.";
+
+static bool reflink(const filesystem::path &from, const filesystem::path &to)
+{
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0)
+    {
+        close(in);
+        return false;
+    }
+    bool ok = ioctl(out, FICLONE, in) == 0;
+    close(in);
+    close(out);
+    if (!ok)
+    {
+        unlink(to.c_str());
+    }
+    return ok;
+}
+
+void link_or_copy(const filesystem::path &from, const filesystem::path &to)
+{
+    // Never write through an existing name, it may share its inode with a cache entry
+    filesystem::remove(to);
+    if (link(from.c_str(), to.c_str()) == 0 || reflink(from, to))
+    {
+        return;
+    }
+    filesystem::copy_file(from, to);
+}
+
+uint64_t parse_byte_size(const string &text)
+{
+    size_t used = 0;
+    uint64_t value = stoull(text, &used);
+    string suffix = text.substr(used);
+    static const string UNITS = "KMGT";
+    if (suffix.empty())
+    {
+        return value;
+    }
+    size_t unit = UNITS.find(toupper(suffix[0]));
+    if (unit == string::npos || suffix.size() > 2 || (suffix.size() == 2 && toupper(suffix[1]) != 'B'))
+    {
+        throw invalid_argument("Invalid size " + text);
+    }
+    return value << (10 * (unit + 1));
+}
+
+result_cache_t::result_cache_t(const filesystem::path &directory, uint64_t max_bytes)
+    : directory_(directory), max_bytes_(max_bytes)
+{
+    filesystem::create_directories(directory_);
+
+    filesystem::path log_path = directory_ / ACCESS_LOG;
+    if (filesystem::exists(log_path))
+    {
+        load_log(log_path);
+    }
+    else
+    {
+        scan();
+    }
+
+    // Rewritten with one line per entry, oldest first, so the log does not grow across runs
+    filesystem::path compacted = log_path.string() + TEMPORARY_INFIX + to_string(getpid());
+    {
+        ofstream out(compacted, ios::trunc);
+        for (auto &[use, name] : lru_)
+        {
+            out << log_line(name, entries_[name].bytes);
+        }
+        out.close();
+        if (!out)
+        {
+            throw runtime_error("Failed to write " + compacted.string());
+        }
+    }
+    filesystem::rename(compacted, log_path);
+    log_fd_ = open(log_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (log_fd_ < 0)
+    {
+        throw runtime_error("Failed to open " + log_path.string() + ": " + strerror(errno));
+    }
+}
+
+void result_cache_t::load_log(const filesystem::path &log_path)
+{
+    ifstream log(log_path);
+    string line;
+    while (getline(log, line))
+    {
+        // Caches from before sizes were logged have bare names, their sizes come from the files
+        size_t space = line.find(' ');
+        string name = space == string::npos ? line : line.substr(space + 1);
+        string size = space == string::npos ? "" : line.substr(0, space);
+        if (name.empty())
+        {
+            continue;
+        }
+        if (size == REMOVED)
+        {
+            forget(name);
+            continue;
+        }
+
+        uint64_t bytes = 0;
+        try
+        {
+            bytes = size.empty() ? filesystem::file_size(directory_ / name) : stoull(size);
+        }
+        catch (const exception &)
+        {
+            // Gone since, or a line cut short by a crash
+            continue;
+        }
+        auto it = entries_.find(name);
+        if (it == entries_.end())
+        {
+            it = entries_.emplace(name, entry_t{0, 0}).first;
+        }
+        stats_.bytes += bytes - it->second.bytes;
+        it->second.bytes = bytes;
+        touch(name, it->second);
+    }
+}
+
+void result_cache_t::scan()
+{
+    // Without a log the entries are ordered by modification time
+    vector<pair<filesystem::file_time_type, pair<string, uint64_t>>> found;
+    for (auto &file : filesystem::recursive_directory_iterator{directory_})
+    {
+        if (!file.is_regular_file())
+        {
+            continue;
+        }
+        string name = filesystem::relative(file.path(), directory_).string();
+        if (name.find(TEMPORARY_INFIX) != string::npos)
+        {
+            // Left by a store that died before its rename
+            error_code ignored;
+            filesystem::remove(file.path(), ignored);
+            continue;
+        }
+        found.push_back({file.last_write_time(), {name, file.file_size()}});
+    }
+    sort(found.begin(), found.end());
+    for (auto &[time, file] : found)
+    {
+        entry_t entry{file.second, 0};
+        touch(file.first, entry);
+        entries_[file.first] = entry;
+        stats_.bytes += file.second;
+    }
+}
+
+string result_cache_t::log_line(const string &name, uint64_t bytes)
+{
+    return to_string(bytes) + ' ' + name + '\n';
+}
+
+result_cache_t::~result_cache_t()
+{
+    close(log_fd_);
+}
+
+filesystem::path result_cache_t::entry_path(const string &key, const string &extension) const
+{
+    // Two-level fan-out keeps directories small
+    return directory_ / key.substr(0, 2) / (key + extension);
+}
+
+void result_cache_t::touch(const string &name, entry_t &entry)
+{
+    if (entry.last_use)
+    {
+        lru_.erase(entry.last_use);
+    }
+    entry.last_use = ++clock_;
+    lru_[entry.last_use] = name;
+}
+
+void result_cache_t::append_log(const string &lines)
+{
+    // One append per call keeps lines whole; a lost use only makes its entry look older
+    if (write(log_fd_, lines.data(), lines.size()) < 0)
+    {
+        return;
+    }
+}
+
+bool result_cache_t::fetch(const string &key, const string &extension, output_writer_t &writer, const string &output_path,
+                           output_writer_t::committed_t committed)
+{
+    filesystem::path path = entry_path(key, extension);
+    string name = filesystem::relative(path, directory_).string();
+    string used;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = entries_.find(name);
+        if (it == entries_.end())
+        {
+            stats_.misses++;
+            return false;
+        }
+        touch(name, it->second);
+        used = log_line(name, it->second.bytes);
+        auto sidecar = entries_.find(name + SIDECAR_SUFFIX);
+        if (sidecar != entries_.end())
+        {
+            touch(sidecar->first, sidecar->second);
+            used += log_line(sidecar->first, sidecar->second.bytes);
+        }
+    }
+
+    try
+    {
+        filesystem::path sidecar = path.string() + SIDECAR_SUFFIX;
+        if (filesystem::exists(sidecar))
+        {
+            writer.link(sidecar, output_path + SIDECAR_SUFFIX);
+        }
+        writer.link(path, output_path, move(committed));
+    }
+    catch (const filesystem::filesystem_error &)
+    {
+        // Entry evicted since the lookup, treat it as a miss
+        bool gone = !filesystem::exists(path);
+        if (gone)
+        {
+            append_log(REMOVED + ' ' + name + '\n' + REMOVED + ' ' + name + SIDECAR_SUFFIX + '\n');
+        }
+        lock_guard<mutex> lock(mutex_);
+        if (gone)
+        {
+            forget(name);
+            forget(name + SIDECAR_SUFFIX);
+        }
+        stats_.misses++;
+        return false;
+    }
+    append_log(used);
+
+    lock_guard<mutex> lock(mutex_);
+    stats_.hits++;
+    return true;
+}
+
+void result_cache_t::store(const string &key, const string &extension, const string &output_path)
+{
+    filesystem::path path = entry_path(key, extension);
+    filesystem::create_directories(path.parent_path());
+
+    vector<pair<filesystem::path, filesystem::path>> files = {{output_path, path}};
+    if (filesystem::exists(output_path + SIDECAR_SUFFIX))
+    {
+        files.push_back({output_path + SIDECAR_SUFFIX, path.string() + SIDECAR_SUFFIX});
+    }
+
+    // The links are made without the lock, under a name of their own that is renamed
+    // over the entry, so stores of the same key from other workers cannot collide
+    vector<string> names;
+    vector<uint64_t> sizes;
+    for (auto &[from, to] : files)
+    {
+        filesystem::path temporary = to.string() + TEMPORARY_INFIX + to_string(getpid()) + "." + to_string(temporaries_++);
+        try
+        {
+            link_or_copy(from, temporary);
+            sizes.push_back(filesystem::file_size(temporary));
+            filesystem::rename(temporary, to);
+        }
+        catch (...)
+        {
+            error_code ignored;
+            filesystem::remove(temporary, ignored);
+            throw;
+        }
+        names.push_back(filesystem::relative(to, directory_).string());
+    }
+
+    vector<string> evicted;
+    string lines;
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            auto it = entries_.find(names[i]);
+            if (it != entries_.end())
+            {
+                stats_.bytes -= it->second.bytes;
+                it->second.bytes = sizes[i];
+            }
+            else
+            {
+                it = entries_.emplace(names[i], entry_t{sizes[i], 0}).first;
+            }
+            touch(names[i], it->second);
+            stats_.bytes += sizes[i];
+            lines += log_line(names[i], sizes[i]);
+        }
+        stats_.stores++;
+        evicted = evict();
+    }
+    for (const string &name : evicted)
+    {
+        lines += REMOVED + ' ' + name + '\n';
+    }
+    append_log(lines);
+    for (const string &name : evicted)
+    {
+        error_code ignored;
+        filesystem::remove(directory_ / name, ignored);
+    }
+}
+
+void result_cache_t::forget(const string &name)
+{
+    auto it = entries_.find(name);
+    if (it == entries_.end())
+    {
+        return;
+    }
+    lru_.erase(it->second.last_use);
+    stats_.bytes -= it->second.bytes;
+    entries_.erase(it);
+}
+
+vector<string> result_cache_t::evict()
+{
+    vector<string> evicted;
+    while (max_bytes_ && stats_.bytes > max_bytes_ && !lru_.empty())
+    {
+        // An image and its sidecar leave together
+        string name = lru_.begin()->second;
+        bool sidecar = name.size() > SIDECAR_SUFFIX.size() && name.compare(name.size() - SIDECAR_SUFFIX.size(), string::npos, SIDECAR_SUFFIX) == 0;
+        string image = sidecar ? name.substr(0, name.size() - SIDECAR_SUFFIX.size()) : name;
+        for (const string &victim : {image, image + SIDECAR_SUFFIX})
+        {
+            if (entries_.count(victim))
+            {
+                forget(victim);
+                evicted.push_back(victim);
+            }
+        }
+        stats_.evictions++;
+    }
+    return evicted;
+}
+
+result_cache_t::stats_t result_cache_t::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "output_writer.h"
+
+// On-disk cache of finished outputs, addressed by content_key() of the input
+// bytes and the blur/encode parameters. Entries are hardlinked (or reflinked,
+// or copied as a last resort) between the cache and the output directory, and
+// the least recently used ones are evicted once the cache exceeds max_bytes.
+// Uses are appended to an access log in the cache directory rather than stamped
+// on the entries, whose inodes the outputs linked from them share. The log also
+// records sizes and evictions, so opening the cache only replays it; the
+// directory is scanned when there is no log, and removing it forces a rescan.
+class result_cache_t
+{
+public:
+    struct stats_t
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+        uint64_t bytes = 0;
+    };
+
+    // max_bytes of 0 disables the size limit
+    result_cache_t(const std::filesystem::path &directory, uint64_t max_bytes);
+    ~result_cache_t();
+
+    result_cache_t(const result_cache_t &) = delete;
+    result_cache_t &operator=(const result_cache_t &) = delete;
+
+    // Gives output_path the entry for key through writer, like any other output, and
+    // passes committed on to it; returns false on a miss
+    bool fetch(const std::string &key, const std::string &extension, output_writer_t &writer, const std::string &output_path,
+               output_writer_t::committed_t committed = {});
+
+    // Records output_path (and its .json sidecar, if any) as the entry for key
+    void store(const std::string &key, const std::string &extension, const std::string &output_path);
+
+    stats_t stats() const;
+
+private:
+    struct entry_t
+    {
+        uint64_t bytes;
+        uint64_t last_use;
+    };
+
+    void load_log(const std::filesystem::path &log_path);
+    void scan();
+    static std::string log_line(const std::string &name, uint64_t bytes);
+    std::filesystem::path entry_path(const std::string &key, const std::string &extension) const;
+    void touch(const std::string &name, entry_t &entry);
+    // Bookkeeping only, the callers remove the files once the lock is released
+    void forget(const std::string &name);
+    std::vector<std::string> evict();
+    void append_log(const std::string &lines);
+
+    std::filesystem::path directory_;
+    uint64_t max_bytes_;
+    int log_fd_ = -1;
+    std::atomic<uint64_t> temporaries_{0};
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, entry_t> entries_;
+    // last_use -> entry name, oldest first
+    std::map<uint64_t, std::string> lru_;
+    uint64_t clock_ = 0;
+    stats_t stats_;
+};
+
+// Gives from's contents the new name to: hardlink, reflink or copy, whichever works first
+void link_or_copy(const std::filesystem::path &from, const std::filesystem::path &to);
+
+// Parses sizes like 512M or 20G
+uint64_t parse_byte_size(const std::string &text);
@@ -0,0 +1,123 @@
+#include "roofline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+// Every measurement repeats its loop until it ran at least this long, best of
+// MEASUREMENT_ROUNDS counts
+static const chrono::milliseconds MIN_MEASUREMENT_TIME(100);
+static const int MEASUREMENT_ROUNDS = 3;
+// Largest working set used for main memory, keeps calibration within small containers
+static const size_t MAX_MEMORY_WORKING_SET = 512ull << 20;
+
+// Keeps results of the measured loops alive
+static volatile double sink;
+
+static size_t cache_size(int name, size_t fallback)
+{
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+// Best rate over MEASUREMENT_ROUNDS of units processed per second by one pass
+template <typename F>
+static double best_rate(double units_per_pass, F pass)
+{
+    double best = 0;
+    for (int round = 0; round < MEASUREMENT_ROUNDS; ++round)
+    {
+        size_t passes = 0;
+        auto start_time = chrono::steady_clock::now();
+        chrono::duration<double> elapsed;
+        do
+        {
+            pass();
+            passes++;
+            elapsed = chrono::steady_clock::now() - start_time;
+        } while (elapsed < MIN_MEASUREMENT_TIME);
+        best = max(best, units_per_pass * passes / elapsed.count());
+    }
+    return best;
+}
+
+static bandwidth_level_t measure_level(const string &name, size_t working_set)
+{
+    // Three arrays share the working set, as in STREAM
+    size_t n = max<size_t>(working_set / 3 / sizeof(double), 64);
+    vector<double> a(n, 1.0), b(n, 2.0), c(n, 0.5);
+    const double scalar = 3.0;
+
+    bandwidth_level_t level{name, 3 * n * sizeof(double), 0, 0};
+    // Bytes counted the STREAM way: what the loop reads and writes, ignoring write-allocate traffic
+    level.copy_bytes_per_s = best_rate(2.0 * n * sizeof(double), [&]()
+                                       {
+                                           copy(a.begin(), a.end(), c.begin());
+                                           sink = c[n / 2]; });
+    level.triad_bytes_per_s = best_rate(3.0 * n * sizeof(double), [&]()
+                                        {
+                                            for (size_t i = 0; i < n; ++i)
+                                            {
+                                                a[i] = b[i] + scalar * c[i];
+                                            }
+                                            sink = a[n / 2]; });
+    return level;
+}
+
+// Dependent chains of shifts, adds and xors on 16-bit lanes, few loads per operation
+static double measure_int_ops()
+{
+    static const size_t LANES = 2048;
+    static const int ROUNDS = 16;
+    vector<uint16_t> values(LANES);
+    for (size_t i = 0; i < LANES; ++i)
+    {
+        values[i] = i;
+    }
+    // Three operations per lane and round
+    return best_rate(3.0 * LANES * ROUNDS, [&]()
+                     {
+                         for (size_t i = 0; i < LANES; ++i)
+                         {
+                             uint16_t v = values[i];
+                             for (int r = 0; r < ROUNDS; ++r)
+                             {
+                                 v = (v + (v >> 3)) ^ 0x5a5a;
+                             }
+                             values[i] = v;
+                         }
+                         sink = values[LANES / 2]; });
+}
+
+machine_peaks_t calibrate_machine()
+{
+    size_t l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+    size_t l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 1 << 20);
+    size_t l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, 32 << 20);
+
+    machine_peaks_t peaks;
+    // Half of each level leaves room for the stack, code and the other arrays
+    peaks.levels.push_back(measure_level("L1", l1 / 2));
+    peaks.levels.push_back(measure_level("L2", l2 / 2));
+    peaks.levels.push_back(measure_level("L3", l3 / 2));
+    peaks.levels.push_back(measure_level("memory", min(max<size_t>(4 * l3, 64 << 20), MAX_MEMORY_WORKING_SET)));
+    peaks.int_ops_per_s = measure_int_ops();
+    return peaks;
+}
+
+const bandwidth_level_t &limiting_level(const machine_peaks_t &peaks, size_t bytes)
+{
+    for (const bandwidth_level_t &level : peaks.levels)
+    {
+        if (bytes <= level.working_set)
+        {
+            return level;
+        }
+    }
+    return peaks.levels.back();
+}
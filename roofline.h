@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Attainable bandwidth of one level of the memory hierarchy
+struct bandwidth_level_t
+{
+    std::string name;
+    // Bytes per array of the measured working set, sized to fit the level
+    size_t working_set;
+    double copy_bytes_per_s;
+    double triad_bytes_per_s;
+};
+
+// Measured peaks of this machine for a single thread
+struct machine_peaks_t
+{
+    // Innermost level first, main memory last
+    std::vector<bandwidth_level_t> levels;
+    // Vectorized 16-bit integer operations per second on L1-resident data
+    double int_ops_per_s;
+};
+
+// STREAM-style copy and triad at working sets that fit L1, L2 and L3 and one
+// that does not, plus an integer throughput loop. Takes a few seconds.
+machine_peaks_t calibrate_machine();
+
+// The level whose bandwidth limits a kernel streaming bytes of data, the
+// innermost one the data fits in
+const bandwidth_level_t &limiting_level(const machine_peaks_t &peaks, size_t bytes);
@@ -0,0 +1,381 @@
+#include "stage_profile.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+const char *to_string(stage_t stage)
+{
+    switch (stage)
+    {
+    case stage_t::read:
+        return "read";
+    case stage_t::decode:
+        return "decode";
+    case stage_t::deinterleave:
+        return "deinterleave";
+    case stage_t::blur:
+        return "blur";
+    case stage_t::interleave:
+        return "interleave";
+    case stage_t::encode:
+        return "encode";
+    case stage_t::write:
+        return "write";
+    case stage_t::cache:
+        return "cache";
+    case stage_t::count:
+        break;
+    }
+    return "unknown";
+}
+
+uint64_t stage_times_t::total() const
+{
+    uint64_t sum = 0;
+    for (uint64_t ns : this->ns)
+    {
+        sum += ns;
+    }
+    return sum;
+}
+
+static atomic<uint64_t> next_profile_id{1};
+
+stage_profile_t::stage_profile_t(bool keep_rows) : keep_rows_(keep_rows), id_(next_profile_id++)
+{
+}
+
+stage_profile_t::shard_t &stage_profile_t::local_shard()
+{
+    thread_local uint64_t owner = 0;
+    thread_local shard_t *shard = nullptr;
+    if (owner != id_)
+    {
+        lock_guard<mutex> lock(mutex_);
+        shards_.push_back(make_unique<shard_t>());
+        shard = shards_.back().get();
+        owner = id_;
+    }
+    return *shard;
+}
+
+void stage_profile_t::add(stage_times_t times)
+{
+    shard_t &shard = local_shard();
+    shard.images.fetch_add(1, memory_order_relaxed);
+    for (size_t s = 0; s < STAGE_COUNT; ++s)
+    {
+        shard.totals[s].fetch_add(times.ns[s], memory_order_relaxed);
+        if (times.ns[s])
+        {
+            shard.latencies[s].record(times.ns[s]);
+        }
+    }
+    if (times.queue_ns)
+    {
+        shard.queue_total.fetch_add(times.queue_ns, memory_order_relaxed);
+        shard.latencies[QUEUE_SERIES].record(times.queue_ns);
+    }
+    shard.latencies[END_TO_END_SERIES].record(times.queue_ns + times.total());
+    shard.pixels.fetch_add(times.pixels, memory_order_relaxed);
+    for (size_t s = 0; s < STAGE_COUNT; ++s)
+    {
+        for (size_t e = 0; e < PERF_EVENT_COUNT; ++e)
+        {
+            if (times.events[s][e])
+            {
+                shard.events[s][e].fetch_add(times.events[s][e], memory_order_relaxed);
+            }
+        }
+        if (times.uncounted[s])
+        {
+            shard.uncounted[s].fetch_add(times.uncounted[s], memory_order_relaxed);
+        }
+    }
+
+    if (keep_rows_)
+    {
+        lock_guard<mutex> lock(mutex_);
+        rows_.push_back(move(times));
+    }
+}
+
+void stage_profile_t::print_summary(ostream &out) const
+{
+    size_t images = 0;
+    array<uint64_t, STAGE_COUNT> totals{};
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (const unique_ptr<shard_t> &shard : shards_)
+        {
+            images += shard->images.load(memory_order_relaxed);
+            for (size_t s = 0; s < STAGE_COUNT; ++s)
+            {
+                totals[s] += shard->totals[s].load(memory_order_relaxed);
+            }
+        }
+    }
+    if (!images)
+    {
+        return;
+    }
+    uint64_t sum = 0;
+    for (uint64_t ns : totals)
+    {
+        sum += ns;
+    }
+    // Stage times add up across worker threads, so the total can exceed the elapsed time
+    out << "Stages over " << images << " images:\n"
+        << "  " << left << setw(14) << "stage" << right << setw(12) << "total ms" << setw(12) << "mean ms" << setw(8) << "share" << '\n';
+    for (size_t s = 0; s < STAGE_COUNT; ++s)
+    {
+        out << "  " << left << setw(14) << to_string(static_cast<stage_t>(s)) << right << fixed << setprecision(1) << setw(12)
+            << totals[s] / 1e6 << setprecision(3) << setw(12) << totals[s] / 1e6 / images << setprecision(1) << setw(7)
+            << (sum ? 100.0 * totals[s] / sum : 0) << "%\n";
+    }
+    out << "  " << left << setw(14) << "total" << right << setprecision(1) << setw(12) << sum / 1e6 << setprecision(3) << setw(12)
+        << sum / 1e6 / images << defaultfloat << endl;
+}
+
+void stage_profile_t::print_latencies(ostream &out) const
+{
+    array<latency_histogram_t, SERIES_COUNT> merged;
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (const unique_ptr<shard_t> &shard : shards_)
+        {
+            for (size_t s = 0; s < SERIES_COUNT; ++s)
+            {
+                merged[s].add(shard->latencies[s]);
+            }
+        }
+    }
+    if (!merged[END_TO_END_SERIES].count())
+    {
+        return;
+    }
+
+    static const double PERCENTILES[] = {50, 90, 99, 99.9};
+    // Built as one string, the periodic report shares the stream with the workers
+    ostringstream report;
+    report << "Latency ms:\n  " << left << setw(14) << "stage" << right << setw(9) << "count" << setw(10) << "p50" << setw(10) << "p90"
+           << setw(10) << "p99" << setw(10) << "p99.9" << setw(10) << "max" << '\n';
+    for (size_t s = 0; s < SERIES_COUNT; ++s)
+    {
+        const latency_histogram_t &histogram = merged[s];
+        if (!histogram.count())
+        {
+            continue;
+        }
+        string name = s == QUEUE_SERIES ? "queue" : s == END_TO_END_SERIES ? "end-to-end" : to_string(static_cast<stage_t>(s));
+        report << "  " << left << setw(14) << name << right << setw(9) << histogram.count() << fixed << setprecision(3);
+        for (double percent : PERCENTILES)
+        {
+            report << setw(10) << histogram.percentile(percent) / 1e6;
+        }
+        report << setw(10) << histogram.max() / 1e6 << '\n';
+    }
+    out << report.str() << flush;
+}
+
+void stage_profile_t::write_prometheus(ostream &out, const string &name) const
+{
+    static const double BUCKET_SECONDS[] = {0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+    array<latency_histogram_t, SERIES_COUNT> merged;
+    array<uint64_t, SERIES_COUNT> sums{};
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (const unique_ptr<shard_t> &shard : shards_)
+        {
+            for (size_t s = 0; s < SERIES_COUNT; ++s)
+            {
+                merged[s].add(shard->latencies[s]);
+            }
+            for (size_t s = 0; s < STAGE_COUNT; ++s)
+            {
+                sums[s] += shard->totals[s].load(memory_order_relaxed);
+                sums[END_TO_END_SERIES] += shard->totals[s].load(memory_order_relaxed);
+            }
+            sums[QUEUE_SERIES] += shard->queue_total.load(memory_order_relaxed);
+            sums[END_TO_END_SERIES] += shard->queue_total.load(memory_order_relaxed);
+        }
+    }
+
+    out << "# HELP " << name << " Latency of pipeline stages per image\n# TYPE " << name << " histogram\n";
+    for (size_t s = 0; s < SERIES_COUNT; ++s)
+    {
+        const latency_histogram_t &histogram = merged[s];
+        string stage = s == QUEUE_SERIES ? "queue" : s == END_TO_END_SERIES ? "end_to_end" : to_string(static_cast<stage_t>(s));
+        for (double seconds : BUCKET_SECONDS)
+        {
+            out << name << "_bucket{stage=\"" << stage << "\",le=\"" << seconds << "\"} " << histogram.count_at_or_below(seconds * 1e9) << '\n';
+        }
+        out << name << "_bucket{stage=\"" << stage << "\",le=\"+Inf\"} " << histogram.count() << '\n';
+        out << name << "_sum{stage=\"" << stage << "\"} " << sums[s] / 1e9 << '\n';
+        out << name << "_count{stage=\"" << stage << "\"} " << histogram.count() << '\n';
+    }
+}
+
+void stage_profile_t::print_events(ostream &out) const
+{
+    uint64_t pixels = 0;
+    array<perf_counts_t, STAGE_COUNT> events{};
+    array<uint64_t, STAGE_COUNT> uncounted{};
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (const unique_ptr<shard_t> &shard : shards_)
+        {
+            pixels += shard->pixels.load(memory_order_relaxed);
+            for (size_t s = 0; s < STAGE_COUNT; ++s)
+            {
+                for (size_t e = 0; e < PERF_EVENT_COUNT; ++e)
+                {
+                    events[s][e] += shard->events[s][e].load(memory_order_relaxed);
+                }
+                uncounted[s] += shard->uncounted[s].load(memory_order_relaxed);
+            }
+        }
+    }
+    const size_t cycles = static_cast<size_t>(perf_event_t::cycles);
+    const size_t instructions = static_cast<size_t>(perf_event_t::instructions);
+    bool counted = false;
+    for (size_t s = 0; s < STAGE_COUNT; ++s)
+    {
+        counted = counted || events[s][cycles] || uncounted[s];
+    }
+    if (!counted || !pixels)
+    {
+        return;
+    }
+
+    // Only the worker thread is counted, e.g. parallel deflate helpers are not
+    out << "Hardware events per pixel over " << pixels << " pixels:\n  " << left << setw(14) << "stage" << right << setw(8) << "IPC"
+        << setw(10) << "cycles";
+    for (size_t e = static_cast<size_t>(perf_event_t::l1d_misses); e < PERF_EVENT_COUNT; ++e)
+    {
+        out << setw(15) << to_string(static_cast<perf_event_t>(e));
+    }
+    out << '\n';
+    for (size_t s = 0; s < STAGE_COUNT; ++s)
+    {
+        if (!events[s][cycles] && !uncounted[s])
+        {
+            continue;
+        }
+        out << "  " << left << setw(14) << to_string(static_cast<stage_t>(s)) << right;
+        if (!events[s][cycles])
+        {
+            out << "  not counted\n";
+            continue;
+        }
+        out << fixed << setprecision(2) << setw(8) << double(events[s][instructions]) / events[s][cycles] << setw(10)
+            << double(events[s][cycles]) / pixels << setprecision(4);
+        for (size_t e = static_cast<size_t>(perf_event_t::l1d_misses); e < PERF_EVENT_COUNT; ++e)
+        {
+            out << setw(15) << double(events[s][e]) / pixels;
+        }
+        if (uncounted[s])
+        {
+            // The rates above leave out these laps but still divide by all pixels
+            out << "  (" << uncounted[s] << " laps not counted)";
+        }
+        out << '\n';
+    }
+    out << defaultfloat << flush;
+}
+
+static string json_escape(const string &text)
+{
+    string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char code[7];
+            snprintf(code, sizeof code, "\\u%04x", c);
+            escaped += code;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static string csv_escape(const string &text)
+{
+    if (text.find_first_of(",\"\n") == string::npos)
+    {
+        return text;
+    }
+    string escaped = "\"";
+    for (char c : text)
+    {
+        escaped += c;
+        if (c == '"')
+        {
+            escaped += '"';
+        }
+    }
+    return escaped + "\"";
+}
+
+void stage_profile_t::write_rows(const string &path) const
+{
+    ofstream out(path);
+    if (!out)
+    {
+        throw runtime_error("Failed to open " + path);
+    }
+    bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+
+    lock_guard<mutex> lock(mutex_);
+    if (json)
+    {
+        out << "[\n";
+        for (size_t i = 0; i < rows_.size(); ++i)
+        {
+            out << "  {\"image\": \"" << json_escape(rows_[i].image) << '"';
+            for (size_t s = 0; s < STAGE_COUNT; ++s)
+            {
+                out << ", \"" << to_string(static_cast<stage_t>(s)) << "_ns\": " << rows_[i].ns[s];
+            }
+            out << ", \"queue_ns\": " << rows_[i].queue_ns;
+            out << ", \"total_ns\": " << rows_[i].total() << (i + 1 < rows_.size() ? "},\n" : "}\n");
+        }
+        out << "]\n";
+    }
+    else
+    {
+        out << "image";
+        for (size_t s = 0; s < STAGE_COUNT; ++s)
+        {
+            out << ',' << to_string(static_cast<stage_t>(s)) << "_ns";
+        }
+        out << ",queue_ns,total_ns\n";
+        for (const stage_times_t &row : rows_)
+        {
+            out << csv_escape(row.image);
+            for (uint64_t ns : row.ns)
+            {
+                out << ',' << ns;
+            }
+            out << ',' << row.queue_ns << ',' << row.total() << '\n';
+        }
+    }
+    if (!out.flush())
+    {
+        throw runtime_error("Failed to write " + path);
+    }
+}
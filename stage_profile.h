@@ -0,0 +1,158 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "latency_histogram.h"
+#include "perf_counters.h"
+#include "trace_recorder.h"
+
+// Pipeline stages of one image, in the order they run
+enum class stage_t
+{
+    read,         // input bytes into memory (with mmap inputs, page faults land in decode)
+    decode,       // codec to interleaved pixels
+    deinterleave, // interleaved pixels to channel planes
+    blur,
+    interleave,   // channel planes back to interleaved pixels
+    encode,
+    write,        // output file, store or archive entry
+    cache,        // result cache lookup and store, manifest bookkeeping
+    count
+};
+
+static const size_t STAGE_COUNT = static_cast<size_t>(stage_t::count);
+
+const char *to_string(stage_t stage);
+
+// Time spent in each stage by one image
+struct stage_times_t
+{
+    std::string image;
+    std::array<uint64_t, STAGE_COUNT> ns{};
+    // From discovery of the input until a worker picked it up, not part of total()
+    uint64_t queue_ns = 0;
+    // Hardware events of the worker thread per stage, zero unless the timer counts them
+    std::array<perf_counts_t, STAGE_COUNT> events{};
+    // Laps of a stage during which the counters were never scheduled, so not in events
+    std::array<uint32_t, STAGE_COUNT> uncounted{};
+    uint64_t pixels = 0;
+
+    uint64_t total() const;
+};
+
+// Attributes the time since the previous lap (or construction) to a stage. One
+// clock read per stage, cheap enough to leave on for every image. With
+// count_events the thread's hardware counters are read as well, which costs a
+// system call per stage. Laps also become spans of the trace while it records.
+class stage_timer_t
+{
+public:
+    explicit stage_timer_t(stage_times_t &times, bool count_events = false)
+        : times_(times), events_(count_events ? &thread_perf_group() : nullptr), last_(std::chrono::steady_clock::now())
+    {
+        if (events_)
+        {
+            last_events_ = events_->read();
+        }
+    }
+
+    void lap(stage_t stage)
+    {
+        auto now = std::chrono::steady_clock::now();
+        size_t s = static_cast<size_t>(stage);
+        times_.ns[s] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_).count();
+        if (trace_enabled())
+        {
+            trace_record(to_string(stage), last_, now, times_.image);
+        }
+        last_ = now;
+        if (events_)
+        {
+            perf_sample_t sample = events_->read();
+            perf_counts_t counts;
+            if (perf_delta(last_events_, sample, counts))
+            {
+                for (size_t e = 0; e < PERF_EVENT_COUNT; ++e)
+                {
+                    times_.events[s][e] += counts[e];
+                }
+            }
+            else
+            {
+                times_.uncounted[s]++;
+            }
+            last_events_ = sample;
+        }
+    }
+
+private:
+    stage_times_t &times_;
+    const perf_group_t *events_;
+    std::chrono::steady_clock::time_point last_;
+    perf_sample_t last_events_{};
+};
+
+// Per-run aggregate of stage times, safe to add to from several threads. Every
+// thread records into its own shard of totals and latency histograms without
+// taking a lock, reports merge the shards. Per-image rows are only kept when
+// keep_rows is set.
+class stage_profile_t
+{
+public:
+    explicit stage_profile_t(bool keep_rows = false);
+
+    void add(stage_times_t times);
+
+    // Total, mean per image and share of every stage
+    void print_summary(std::ostream &out) const;
+
+    // p50/p90/p99/p99.9/max of every stage, queue wait and end to end (queue
+    // wait plus all stages). Stages an image skipped are not recorded for it.
+    void print_latencies(std::ostream &out) const;
+
+    // Stage and end-to-end latencies as Prometheus histograms with the given metric name
+    void write_prometheus(std::ostream &out, const std::string &name) const;
+
+    // Hardware events per stage as IPC and per pixel rates, nothing if none were counted;
+    // stages the counters were multiplexed out of say so
+    void print_events(std::ostream &out) const;
+
+    // One row per image, CSV or a JSON array depending on the extension of path
+    void write_rows(const std::string &path) const;
+
+private:
+    // Histograms after the stages
+    static const size_t QUEUE_SERIES = STAGE_COUNT;
+    static const size_t END_TO_END_SERIES = STAGE_COUNT + 1;
+    static const size_t SERIES_COUNT = STAGE_COUNT + 2;
+
+    struct shard_t
+    {
+        std::atomic<uint64_t> images{0};
+        std::array<std::atomic<uint64_t>, STAGE_COUNT> totals{};
+        std::atomic<uint64_t> queue_total{0};
+        std::array<latency_histogram_t, SERIES_COUNT> latencies;
+        std::atomic<uint64_t> pixels{0};
+        std::array<std::array<std::atomic<uint64_t>, PERF_EVENT_COUNT>, STAGE_COUNT> events{};
+        std::array<std::atomic<uint64_t>, STAGE_COUNT> uncounted{};
+    };
+
+    shard_t &local_shard();
+
+    bool keep_rows_;
+    // Tells the shards of this profile apart in the per-thread lookup
+    uint64_t id_;
+    // Guards shard registration and rows, never taken by add() otherwise
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<shard_t>> shards_;
+    std::vector<stage_times_t> rows_;
+};
@@ -0,0 +1,260 @@
+#include "tar_archive.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+using namespace std;
+
+static const size_t BLOCK_SIZE = 512;
+// Output is staged through a large buffer so the archive goes out in big sequential writes
+static const size_t WRITE_BUFFER_SIZE = 4 << 20;
+
+static uint64_t padded(uint64_t size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+static uint64_t parse_number(const unsigned char *field, size_t length)
+{
+    // GNU base-256 for values that do not fit the octal field
+    if (field[0] & 0x80)
+    {
+        uint64_t value = field[0] & 0x7f;
+        for (size_t i = 1; i < length; ++i)
+        {
+            value = value << 8 | field[i];
+        }
+        return value;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < length && field[i]; ++i)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+        {
+            value = value * 8 + (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+static string parse_string(const unsigned char *field, size_t length)
+{
+    const unsigned char *end = find(field, field + length, 0);
+    return string(field, end);
+}
+
+tar_reader_t::tar_reader_t(const string &path) : file_(path)
+{
+}
+
+bool tar_reader_t::next(tar_member_t &member)
+{
+    string long_name;
+    uint64_t long_size = UINT64_MAX;
+    while (offset_ + BLOCK_SIZE <= file_.size())
+    {
+        const unsigned char *header = file_.data() + offset_;
+        if (all_of(header, header + BLOCK_SIZE, [](unsigned char c) { return c == 0; }))
+        {
+            return false;
+        }
+
+        uint64_t size = long_size != UINT64_MAX ? long_size : parse_number(header + 124, 12);
+        const unsigned char *data = header + BLOCK_SIZE;
+        if (size > file_.size() - offset_ - BLOCK_SIZE)
+        {
+            throw runtime_error("Truncated tar member in " + file_.path());
+        }
+        offset_ += BLOCK_SIZE + padded(size);
+
+        char type = header[156];
+        if (type == 'x')
+        {
+            // pax extended header: records of "<length> <key>=<value>\n" for the next member
+            for (size_t pos = 0; pos < size;)
+            {
+                size_t length = strtoul(reinterpret_cast<const char *>(data + pos), nullptr, 10);
+                if (length == 0 || pos + length > size)
+                {
+                    break;
+                }
+                string record(reinterpret_cast<const char *>(data + pos), length - 1);
+                string entry = record.substr(record.find(' ') + 1);
+                if (entry.rfind("path=", 0) == 0)
+                {
+                    long_name = entry.substr(5);
+                }
+                else if (entry.rfind("size=", 0) == 0)
+                {
+                    long_size = stoull(entry.substr(5));
+                }
+                pos += length;
+            }
+            continue;
+        }
+        if (type == 'L')
+        {
+            long_name = parse_string(data, size);
+            continue;
+        }
+        if (type != '0' && type != '\0' && type != '7')
+        {
+            long_name.clear();
+            long_size = UINT64_MAX;
+            continue;
+        }
+
+        if (!long_name.empty())
+        {
+            member.name = long_name;
+        }
+        else
+        {
+            member.name = parse_string(header, 100);
+            string prefix = parse_string(header + 345, 155);
+            if (memcmp(header + 257, "ustar", 5) == 0 && !prefix.empty())
+            {
+                member.name = prefix + "/" + member.name;
+            }
+        }
+        member.data = data;
+        member.size = size;
+        return true;
+    }
+    return false;
+}
+
+tar_writer_t::tar_writer_t(const string &path, size_t window) : buffer_(WRITE_BUFFER_SIZE), window_(max<size_t>(window, 1))
+{
+    out_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+    out_.open(path, ios::binary | ios::trunc);
+    if (!out_)
+    {
+        throw runtime_error("Failed to create " + path);
+    }
+}
+
+void tar_writer_t::submit(size_t index, vector<tar_entry_t> entries)
+{
+    unique_lock<mutex> lock(mutex_);
+    advanced_.wait(lock, [&] { return failed_ || index < next_index_ + window_; });
+    if (failed_)
+    {
+        throw runtime_error("Failed to write tar archive");
+    }
+    pending_[index] = move(entries);
+    try
+    {
+        for (auto it = pending_.begin(); it != pending_.end() && it->first == next_index_; it = pending_.erase(it))
+        {
+            for (const tar_entry_t &entry : it->second)
+            {
+                write(entry);
+            }
+            next_index_++;
+        }
+        if (!out_)
+        {
+            throw runtime_error("Failed to write tar archive");
+        }
+    }
+    catch (...)
+    {
+        // The order cannot advance past a failed write, so nobody waits for it to
+        failed_ = true;
+        advanced_.notify_all();
+        throw;
+    }
+    advanced_.notify_all();
+}
+
+void tar_writer_t::close()
+{
+    lock_guard<mutex> lock(mutex_);
+    if (!pending_.empty())
+    {
+        throw runtime_error("Tar archive closed with results still waiting for earlier ones");
+    }
+    static const char end[2 * BLOCK_SIZE] = {};
+    out_.write(end, sizeof end);
+    out_.close();
+    if (!out_)
+    {
+        throw runtime_error("Failed to write tar archive");
+    }
+}
+
+void tar_writer_t::write(const tar_entry_t &entry)
+{
+    write_header(entry.name, entry.data.size(), '0');
+    out_.write(reinterpret_cast<const char *>(entry.data.data()), entry.data.size());
+    pad(entry.data.size());
+}
+
+void tar_writer_t::pad(uint64_t size)
+{
+    static const char zeros[BLOCK_SIZE] = {};
+    out_.write(zeros, padded(size) - size);
+}
+
+void tar_writer_t::write_header(const string &name, uint64_t size, char type)
+{
+    string stored_name = name;
+    string prefix;
+    if (name.size() > 100)
+    {
+        // ustar splits long paths at a slash into prefix and name
+        size_t slash = name.find('/', name.size() > 101 ? name.size() - 101 : 0);
+        if (slash != string::npos && slash <= 155 && name.size() - slash - 1 <= 100 && slash > 0)
+        {
+            prefix = name.substr(0, slash);
+            stored_name = name.substr(slash + 1);
+        }
+        else
+        {
+            // Otherwise a pax header carries the full path
+            string record = " path=" + name + "\n";
+            size_t length = record.size() + 1;
+            while (to_string(length).size() + record.size() != length)
+            {
+                length++;
+            }
+            record = to_string(length) + record;
+            write_header("PaxHeader", record.size(), 'x');
+            out_.write(record.data(), record.size());
+            pad(record.size());
+            stored_name = name.substr(name.size() - 100);
+        }
+    }
+
+    if (size >= (uint64_t(1) << 33))
+    {
+        throw runtime_error("Tar member " + name + " is too large");
+    }
+
+    char header[BLOCK_SIZE] = {};
+    memcpy(header, stored_name.data(), stored_name.size());
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+    snprintf(header + 136, 12, "%011llo", static_cast<unsigned long long>(time(nullptr)));
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    memcpy(header + 345, prefix.data(), prefix.size());
+
+    // The checksum is computed with its own field set to spaces
+    memset(header + 148, ' ', 8);
+    unsigned checksum = 0;
+    for (unsigned char c : header)
+    {
+        checksum += c;
+    }
+    snprintf(header + 148, 8, "%06o", checksum);
+    header[155] = ' ';
+    out_.write(header, sizeof header);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Regular file inside a tar archive, data points into the reader's mapping
+struct tar_member_t
+{
+    std::string name;
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+};
+
+// Sequential reader of ustar/pax/GNU archives through one read-only mapping.
+// Directories, links and other special members are skipped.
+class tar_reader_t
+{
+public:
+    explicit tar_reader_t(const std::string &path);
+
+    // Returns false at the end of the archive
+    bool next(tar_member_t &member);
+
+private:
+    mapped_file_t file_;
+    size_t offset_ = 0;
+};
+
+// File to be stored in an output archive
+struct tar_entry_t
+{
+    std::string name;
+    std::vector<unsigned char> data;
+};
+
+// ustar writer that emits entries in submission index order: results that finish
+// early wait in a reorder buffer until all the ones before them are written.
+// submit() blocks while an index is more than window entries ahead of the next
+// one due, which bounds the buffer.
+class tar_writer_t
+{
+public:
+    tar_writer_t(const std::string &path, size_t window);
+
+    // entries of one index are written together, an empty list just advances the order.
+    // Once a write fails, this and every later submit throws.
+    void submit(size_t index, std::vector<tar_entry_t> entries);
+
+    // Writes the end-of-archive marker, all indices up to the last one must have been submitted
+    void close();
+
+private:
+    void write(const tar_entry_t &entry);
+    void write_header(const std::string &name, uint64_t size, char type);
+    void pad(uint64_t size);
+
+    std::ofstream out_;
+    std::vector<char> buffer_;
+    size_t window_;
+    std::mutex mutex_;
+    std::condition_variable advanced_;
+    std::map<size_t, std::vector<tar_entry_t>> pending_;
+    size_t next_index_ = 0;
+    bool failed_ = false;
+};
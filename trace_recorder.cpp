@@ -0,0 +1,181 @@
+#include "trace_recorder.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+atomic<bool> trace_active{false};
+
+namespace
+{
+struct trace_event_t
+{
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    char detail[48];
+};
+
+// Single writer ring. head counts every event ever written, readers use it to
+// tell which slots the writer may have overwritten while they were copying.
+struct trace_ring_t
+{
+    explicit trace_ring_t(size_t capacity) : events(capacity) {}
+
+    vector<trace_event_t> events;
+    atomic<uint64_t> head{0};
+    string thread_name;
+    int tid = 0;
+};
+
+mutex registry_mutex;
+vector<unique_ptr<trace_ring_t>> rings;
+size_t ring_capacity = 1;
+const chrono::steady_clock::time_point trace_epoch = chrono::steady_clock::now();
+
+trace_ring_t *local_ring()
+{
+    thread_local trace_ring_t *ring = nullptr;
+    if (!ring)
+    {
+        lock_guard<mutex> lock(registry_mutex);
+        rings.push_back(make_unique<trace_ring_t>(ring_capacity));
+        ring = rings.back().get();
+        ring->tid = rings.size();
+        ring->thread_name = "thread " + to_string(ring->tid);
+    }
+    return ring;
+}
+
+uint64_t since_epoch(chrono::steady_clock::time_point time)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(time - trace_epoch).count();
+}
+
+void write_json_string(ostream &out, const char *text)
+{
+    out << '"';
+    for (; *text; ++text)
+    {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')
+        {
+            out << '\\' << c;
+        }
+        else if (c < 0x20)
+        {
+            char code[7];
+            snprintf(code, sizeof code, "\\u%04x", c);
+            out << code;
+        }
+        else
+        {
+            out << c;
+        }
+    }
+    out << '"';
+}
+}
+
+void trace_start(size_t events_per_thread)
+{
+    {
+        lock_guard<mutex> lock(registry_mutex);
+        ring_capacity = max<size_t>(1, events_per_thread);
+    }
+    trace_active.store(true, memory_order_relaxed);
+}
+
+void trace_thread_name(const string &name)
+{
+    if (!trace_enabled())
+    {
+        return;
+    }
+    trace_ring_t *ring = local_ring();
+    lock_guard<mutex> lock(registry_mutex);
+    ring->thread_name = name;
+}
+
+void trace_record(const char *name, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end, const string &detail)
+{
+    trace_ring_t *ring = local_ring();
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    trace_event_t &event = ring->events[head % ring->events.size()];
+    event.name = name;
+    event.start_ns = since_epoch(start);
+    event.duration_ns = since_epoch(end) - event.start_ns;
+    size_t length = min(detail.size(), sizeof event.detail - 1);
+    memcpy(event.detail, detail.data(), length);
+    event.detail[length] = 0;
+    ring->head.store(head + 1, memory_order_release);
+}
+
+void trace_dump(const string &path)
+{
+    // Written next to path and renamed, a viewer never opens half a trace
+    string temporary = path + ".tmp";
+    ofstream out(temporary);
+    if (!out)
+    {
+        throw runtime_error("Failed to open " + temporary);
+    }
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    lock_guard<mutex> lock(registry_mutex);
+    for (const unique_ptr<trace_ring_t> &ring : rings)
+    {
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << ring->tid
+            << ", \"args\": {\"name\": ";
+        write_json_string(out, ring->thread_name.c_str());
+        out << "}}";
+        first = false;
+
+        size_t capacity = ring->events.size();
+        uint64_t end = ring->head.load(memory_order_acquire);
+        uint64_t begin = end > capacity ? end - capacity : 0;
+        vector<trace_event_t> events;
+        for (uint64_t i = begin; i < end; ++i)
+        {
+            events.push_back(ring->events[i % capacity]);
+        }
+        // Slots the writer reached while we copied, including the one it may be
+        // writing right now, can hold newer or torn events
+        uint64_t now = ring->head.load(memory_order_acquire);
+        size_t skip = now + 1 > begin + capacity ? min<uint64_t>(events.size(), now + 1 - begin - capacity) : 0;
+
+        for (size_t i = skip; i < events.size(); ++i)
+        {
+            const trace_event_t &event = events[i];
+            out << ",\n{\"name\": ";
+            write_json_string(out, event.name);
+            out << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << ring->tid << ", \"ts\": " << event.start_ns / 1000 << '.'
+                << event.start_ns / 100 % 10 << ", \"dur\": " << event.duration_ns / 1000 << '.' << event.duration_ns / 100 % 10;
+            if (event.detail[0])
+            {
+                out << ", \"args\": {\"image\": ";
+                write_json_string(out, event.detail);
+                out << '}';
+            }
+            out << '}';
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    if (!out)
+    {
+        throw runtime_error("Failed to write " + temporary);
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        throw runtime_error("Failed to rename " + temporary + " to " + path + ": " + strerror(errno));
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Timeline of what every thread did, exported as Chrome trace-event JSON for
+// chrome://tracing or Perfetto. Every thread records into its own ring buffer
+// that keeps the most recent events; while tracing is off recording is one
+// relaxed load and a branch.
+
+extern std::atomic<bool> trace_active;
+
+inline bool trace_enabled()
+{
+    return trace_active.load(std::memory_order_relaxed);
+}
+
+// Turns recording on with room for events_per_thread events in every ring
+void trace_start(size_t events_per_thread);
+
+// Names the calling thread in the exported timeline
+void trace_thread_name(const std::string &name);
+
+// Records a span of the calling thread. name must outlive the trace (a literal),
+// detail is copied and may be truncated.
+void trace_record(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end,
+                  const std::string &detail = "");
+
+// Writes everything recorded so far, safe to call while threads keep recording
+void trace_dump(const std::string &path);
+
+// Records the span from construction to destruction
+class trace_scope_t
+{
+public:
+    explicit trace_scope_t(const char *name) : name_(trace_enabled() ? name : nullptr)
+    {
+        if (name_)
+        {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~trace_scope_t()
+    {
+        if (name_)
+        {
+            trace_record(name_, start_, std::chrono::steady_clock::now());
+        }
+    }
+
+    trace_scope_t(const trace_scope_t &) = delete;
+    trace_scope_t &operator=(const trace_scope_t &) = delete;
+
+private:
+    const char *name_;
+    std::chrono::steady_clock::time_point start_;
+};
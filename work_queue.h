@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+#include "trace_recorder.h"
+
+// Bounded blocking FIFO between producer and consumer threads. push() blocks while
+// the queue is full; once close() is called, consumers drain what is left and
+// then pop() returns false. Blocked pushes and pops show up in the trace.
+template <typename T>
+class work_queue_t
+{
+public:
+    explicit work_queue_t(size_t capacity) : capacity_(capacity ? capacity : 1) {}
+
+    // Returns false if the queue was closed, item is dropped
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto ready = [&] { return closed_ || items_.size() < capacity_; };
+        if (!ready())
+        {
+            trace_scope_t blocked("queue full");
+            not_full_.wait(lock, ready);
+        }
+        if (closed_)
+        {
+            return false;
+        }
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto ready = [&] { return closed_ || !items_.empty(); };
+        if (!ready())
+        {
+            trace_scope_t idle("queue empty");
+            not_empty_.wait(lock, ready);
+        }
+        if (items_.empty())
+        {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return items_.size();
+    }
+
+private:
+    const size_t capacity_;
+    mutable std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};